@@ -0,0 +1,149 @@
+/***********************************************************
+ File Name: arena.c
+ Description: implementation of a bump allocator and of the
+   huge-page backed allocation of large arrays.
+   huge_alloc maps a large array straight from the kernel, in
+   huge pages if any are reserved and otherwise asking for
+   transparent huge pages, so that random accesses into it
+   (bloom filter probes, chunk table slots) miss the TLB less.
+   An arena gets its blocks from huge_alloc, so a large
+   document buffer is backed the same way.
+ **********************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "arena.h"
+
+/* a huge page on x86-64 and arm64 */
+#define HUGE_PAGE (2UL << 20)
+
+/* requests smaller than this are not worth a mapping of their own */
+#define HUGE_MIN (1UL << 20)
+
+/* the header of a block, rounded up so that what follows it stays aligned */
+#define BLOCK_HEADER ((sizeof(arena_block) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+/* Allocate size bytes of zeroed memory, aligned to ARENA_ALIGN. A request
+   of at least HUGE_MIN bytes is mapped in whole huge pages.
+   The memory must be given back with huge_free of the same size. */
+void *
+huge_alloc(size_t size)
+{
+	void *p;
+	size_t len;
+
+	if (size < HUGE_MIN) {
+		if (posix_memalign(&p, ARENA_ALIGN, size > 0 ? size : 1) != 0) {
+			fprintf(stderr, " failed to allocate %lu bytes. No memory\n", (unsigned long)size);
+			exit(1);
+		}
+		memset(p, 0, size);
+		return p;
+	}
+
+	len = (size + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1);
+	p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+	p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+	if (p == MAP_FAILED) {
+		/* no huge pages reserved: ordinary pages the kernel may merge into huge ones */
+		p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED) {
+			fprintf(stderr, " failed to allocate %lu bytes. No memory\n", (unsigned long)size);
+			exit(1);
+		}
+#ifdef MADV_HUGEPAGE
+		madvise(p, len, MADV_HUGEPAGE);
+#endif
+	}
+	return p;
+}
+
+void
+huge_free(void *p, size_t size)
+{
+	if (!p) {
+		return;
+	}
+	if (size < HUGE_MIN) {
+		free(p);
+		return;
+	}
+	munmap(p, (size + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1));
+}
+
+void
+arena_init(arena *a, size_t block_size)
+{
+	a->head = NULL;
+	a->block_size = block_size;
+}
+
+/* Return size bytes from the arena, aligned to ARENA_ALIGN and not zeroed
+   (unless they come from a new block). A request that does not fit in
+   the current block gets a new one, as large as it needs. */
+void *
+arena_alloc(arena *a, size_t size)
+{
+	arena_block *b = a->head;
+	size_t bsz;
+	void *p;
+
+	size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	if (!b || b->size - b->used < size) {
+		bsz = BLOCK_HEADER + size;
+		if (bsz < a->block_size) {
+			bsz = a->block_size;
+		}
+		b = (arena_block *)huge_alloc(bsz);
+		b->size = bsz;
+		b->used = BLOCK_HEADER;
+		b->next = a->head;
+		a->head = b;
+	}
+	p = (char *)b + b->used;
+	b->used += size;
+	return p;
+}
+
+/* Take back everything handed out. The largest block is kept to serve the
+   next requests, so an arena reset between documents of similar sizes
+   does not map and unmap a buffer for each of them. */
+void
+arena_reset(arena *a)
+{
+	arena_block *b, *next, *keep = NULL;
+
+	for (b = a->head; b; b = next) {
+		next = b->next;
+		if (!keep || b->size > keep->size) {
+			if (keep) {
+				huge_free(keep, keep->size);
+			}
+			keep = b;
+		} else {
+			huge_free(b, b->size);
+		}
+	}
+	if (keep) {
+		keep->next = NULL;
+		keep->used = BLOCK_HEADER;
+	}
+	a->head = keep;
+}
+
+void
+arena_free(arena *a)
+{
+	arena_block *b, *next;
+
+	for (b = a->head; b; b = next) {
+		next = b->next;
+		huge_free(b, b->size);
+	}
+	a->head = NULL;
+}
@@ -0,0 +1,32 @@
+/***********************************************************
+ File Name: arena.h
+ Description: definition of a bump allocator and of the
+   huge-page backed allocation of large arrays
+ **********************************************************/
+#include <stddef.h>
+
+/* everything arena_alloc and huge_alloc return is aligned to this many bytes (a cache line) */
+#define ARENA_ALIGN 64
+
+/* one block of an arena; the memory handed out follows this header */
+typedef struct arena_block {
+	struct arena_block *next; /* the block allocated before this one */
+	size_t size;              /* size of the block, including the header */
+	size_t used;              /* bytes of the block handed out, including the header */
+} arena_block;
+
+/* An arena hands out memory from big blocks by bumping a pointer, and
+   takes all of it back at once with arena_reset or arena_free; a single
+   arena must not be used by two threads at a time. */
+typedef struct {
+	arena_block *head;  /* the block being bumped, or NULL */
+	size_t block_size;  /* size of a new block, unless a request needs more */
+} arena;
+
+void arena_init(arena *a, size_t block_size);
+void *arena_alloc(arena *a, size_t size);
+void arena_reset(arena *a);
+void arena_free(arena *a);
+
+void *huge_alloc(size_t size);
+void huge_free(void *p, size_t size);
@@ -4,19 +4,31 @@
  Description: implementation of bloom filter goes here 
  **********************************************************/
 
+#include <math.h>
+
 #include "bloom.h"
+#include "arena.h"
 
 /* Constants for bloom filter implementation */
 const int H1PRIME = 4189793;
 const int H2PRIME = 3296731;
-const int BLOOM_HASH_NUM = 10;
+/* the number of probes per element; make bloombench builds other counts with -DBLOOM_PROBES */
+#ifndef BLOOM_PROBES
+#define BLOOM_PROBES 10
+#endif
+const int BLOOM_HASH_NUM = BLOOM_PROBES;
+
+/* number of elements bloom_add_many and bloom_query_many hash at a time */
+#define BLOOM_MANY_CHUNK 64
 
 /* The hash function used by the bloom filter */
 int
 hash_i(int i, /* which of the BLOOM_HASH_NUM hashes to use */ 
        long long x /* the element (a RK value) to be hashed */)
 {
-	return ((x % H1PRIME) + i*(x % H2PRIME) + 1 + i*i);
+	/* RK values of the 2^64 hash family may be negative as a long long */
+	unsigned long long ux = (unsigned long long)x;
+	return ((ux % H1PRIME) + i*(ux % H2PRIME) + 1 + i*i);
 }
 
 /* Initialize a bloom filter by allocating a character array that can pack bsz bits.
@@ -25,23 +37,365 @@ hash_i(int i, /* which of the BLOOM_HASH_NUM hashes to use */
    Hint:  use the malloc and bzero library function 
 	 Return value is the allocated character array.*/
 bloom_filter
-bloom_init(int bsz /* size of bitmap to allocate in bits*/ )
+bloom_init(long long bsz /* size of bitmap to allocate in bits*/ )
 {
 	bloom_filter f;
 
 	assert((bsz % 8) == 0);
 	f.bsz = bsz;
+	f.layout = BLOOM_CLASSIC;
+
+	/* a large bitmap is probed all over, so it goes in huge pages */
+	f.buf = (char *)huge_alloc(bsz >> 3);
+	return f;
+}
+
+/* Initialize a blocked bloom filter of at least bsz bits. The bitmap is
+   rounded up to whole BLOOM_BLOCK_BITS blocks and aligned to a cache line,
+   so that all BLOOM_HASH_NUM probes of an element touch a single line. */
+bloom_filter
+bloom_init_blocked(long long bsz /* minimum size of bitmap to allocate in bits*/ )
+{
+	bloom_filter f;
+	long long nbytes;
+
+	assert((bsz % 8) == 0);
+	f.bsz = ((bsz + BLOOM_BLOCK_BITS - 1) / BLOOM_BLOCK_BITS) * BLOOM_BLOCK_BITS;
+	if (f.bsz == 0) {
+		f.bsz = BLOOM_BLOCK_BITS;
+	}
+	f.layout = BLOOM_BLOCKED;
+
+	nbytes = f.bsz >> 3;
+	/* huge_alloc aligns to ARENA_ALIGN, which is one block */
+	f.buf = (char *)huge_alloc(nbytes);
+	return f;
+}
+
+/* Initialize a counting bloom filter of bsz 4-bit counters, packed two to
+   a byte (the high nibble first), so it takes 4 times the memory of a
+   classic filter of bsz bits and is probed like one. A counter counts the
+   probes of the added elements that fall on it, up to BLOOM_COUNT_MAX, 
+   so an element can be taken out again with bloom_remove. */
+bloom_filter
+bloom_init_counting(long long bsz /* number of counters to allocate */ )
+{
+	bloom_filter f;
 
-	/* your code here*/
+	assert((bsz % 8) == 0);
+	f.bsz = bsz;
+	f.layout = BLOOM_COUNTING;
+	f.buf = (char *)huge_alloc(bsz >> 1);
 	return f;
 }
 
+/* the size of the buffer of f in bytes */
+long long
+bloom_bytes(bloom_filter f)
+{
+	return (f.layout == BLOOM_COUNTING) ? f.bsz >> 1 : f.bsz >> 3;
+}
+
+/* Return the number of bits (a multiple of 8) a bloom filter needs so that
+   with n elements in it, a query for an element not in it passes with 
+   probability at most fp. With BLOOM_HASH_NUM probes into m bits, that 
+   probability is (1 - e^(-BLOOM_HASH_NUM*n/m))^BLOOM_HASH_NUM. */
+long long
+bloom_bits(long long n, double fp)
+{
+	double m;
+
+	if (n < 1) {
+		n = 1;
+	}
+	m = -BLOOM_HASH_NUM * (double)n / log(1 - pow(fp, 1.0 / BLOOM_HASH_NUM));
+	return (((long long)ceil(m) + 7) >> 3) << 3;
+}
+
+/* Return the position of the first bit of the block of a blocked f that elm's probes fall in */
+static long long
+bloom_block(bloom_filter f, long long elm)
+{
+	unsigned long long nblocks = f.bsz / BLOOM_BLOCK_BITS;
+	unsigned long long mix = (unsigned long long)elm * 0x9E3779B97F4A7C15ULL;
+
+	return (long long)(((mix >> 32) * nblocks) >> 32) * BLOOM_BLOCK_BITS;
+}
+
+/* hash_i(i, elm) is h1 + 1 + i*h2 + i*i with h1 = elm % H1PRIME and 
+   h2 = elm % H2PRIME, so these are computed once per element and each probe
+   follows from the previous one. The classic layout reduces hash_i over the
+   whole bitmap: probe i+1 is probe i plus h2 + 2i + 1, reduced modulo bsz by
+   subtraction. The blocked layout picks one block from a multiplicative hash
+   of elm and reduces hash_i within that block. */
+static inline void
+bloom_hashes(long long elm, unsigned int *h1, unsigned int *h2)
+{
+	/* RK values of the 2^64 hash family may be negative as a long long */
+	unsigned long long ux = (unsigned long long)elm;
+
+	*h1 = ux % H1PRIME;
+	*h2 = ux % H2PRIME;
+}
+
+/* test the bit at position b of f */
+static inline int
+bloom_bit_set(bloom_filter f, long long b)
+{
+	return (f.buf[b >> 3] >> (7 - (b & 7))) & 1;
+}
+
+/* the counter at position b of a counting f */
+static inline int
+bloom_count(bloom_filter f, long long b)
+{
+	return ((unsigned char)f.buf[b >> 1] >> ((b & 1) ? 0 : 4)) & 0xf;
+}
+
+/* add d (1 or -1) to the counter at position b of a counting f */
+static inline void
+bloom_count_add(bloom_filter f, long long b, int d)
+{
+	unsigned char one = (unsigned char)(1u << ((b & 1) ? 0 : 4));
+	unsigned char c = (unsigned char)f.buf[b >> 1];
+
+	f.buf[b >> 1] = (char)((d > 0) ? c + one : c - one);
+}
+
+/* Compute the bit positions of all BLOOM_HASH_NUM probes for elm, whose 
+   hashes are h1 and h2, in f into pos[] (the counter positions of a 
+   counting f, which is probed like a classic one) */
+static inline void
+bloom_positions_h(bloom_filter f, long long elm, unsigned int h1, unsigned int h2, long long *pos)
+{
+	long long base, r, d;
+	int i;
+
+	if (f.layout == BLOOM_BLOCKED) {
+		base = bloom_block(f, elm);
+		for (i = 0; i < BLOOM_PROBES; i++) {
+			pos[i] = base + ((h1 + 1 + i*h2 + i*i) & (BLOOM_BLOCK_BITS - 1));
+		}
+		return;
+	}
+	r = (h1 + 1) % f.bsz;
+	d = h2 % f.bsz;
+	for (i = 0; i < BLOOM_PROBES; i++) {
+		pos[i] = r;
+		r += d + 2*i + 1;
+		while (r >= f.bsz) {
+			r -= f.bsz;
+		}
+	}
+}
+
+/* bloom_positions_h for an elm whose hashes are yet to be computed */
+static inline void
+bloom_positions(bloom_filter f, long long elm, long long *pos)
+{
+	unsigned int h1, h2;
+
+	bloom_hashes(elm, &h1, &h2);
+	bloom_positions_h(f, elm, h1, h2, pos);
+}
+
+/* Return 1 if all probes of the element with hashes h1 and h2 are set in
+   the classic f. A probe is only computed once the previous ones are known
+   to be set, so an element that is not in f usually costs a single modulo
+   bsz. */
+static inline int
+bloom_test_classic(bloom_filter f, unsigned int h1, unsigned int h2)
+{
+	long long r, d = 0;
+	int i;
+
+	r = (h1 + 1) % f.bsz;
+	for (i = 0; i < BLOOM_PROBES; i++) {
+		if (!bloom_bit_set(f, r)) {
+			return 0;
+		}
+		if (i == 0) {
+			d = h2 % f.bsz;
+		}
+		r += d + 2*i + 1;
+		while (r >= f.bsz) {
+			r -= f.bsz;
+		}
+	}
+	return 1;
+}
+
+/* Return 1 if all counters the element with hashes h1 and h2 probes in the
+   counting f are non-zero, computing the probes one at a time like 
+   bloom_test_classic. */
+static inline int
+bloom_test_counting(bloom_filter f, unsigned int h1, unsigned int h2)
+{
+	long long r, d = 0;
+	int i;
+
+	r = (h1 + 1) % f.bsz;
+	for (i = 0; i < BLOOM_PROBES; i++) {
+		if (bloom_count(f, r) == 0) {
+			return 0;
+		}
+		if (i == 0) {
+			d = h2 % f.bsz;
+		}
+		r += d + 2*i + 1;
+		while (r >= f.bsz) {
+			r -= f.bsz;
+		}
+	}
+	return 1;
+}
+
+/* Return 1 if all probes of elm, whose hashes are h1 and h2, are set in
+   the blocked f. They all lie in one cache line, so they are tested 
+   together, without branching on each. */
+static inline int
+bloom_test_blocked(bloom_filter f, long long elm, unsigned int h1, unsigned int h2)
+{
+	long long pos[BLOOM_PROBES];
+	int i, hit = 1;
+
+	bloom_positions_h(f, elm, h1, h2, pos);
+	for (i = 0; i < BLOOM_PROBES; i++) {
+		hit &= bloom_bit_set(f, pos[i]);
+	}
+	return hit;
+}
+
+/* Prefetch the part of f that a query for elm will look at. Only the blocked
+   layout has one: its probes all fall in one cache line, while the classic 
+   layout spreads them over a bitmap that is only used while small enough
+   to stay in cache. */
+void
+bloom_prefetch(bloom_filter f, long long elm)
+{
+	if (f.layout == BLOOM_BLOCKED) {
+		__builtin_prefetch(&f.buf[bloom_block(f, elm) >> 3]);
+	}
+}
+
+/* set the bits at positions pos[] of a classic or blocked f */
+static inline void
+bloom_set_bits(bloom_filter f, const long long *pos)
+{
+	int i;
+
+	for (i = 0; i < BLOOM_PROBES; i++) {
+		f.buf[pos[i] >> 3] |= (char)(0x80 >> (pos[i] & 7));
+	}
+}
+
+/* increment the counters at positions pos[] of a counting f, short of saturation */
+static inline void
+bloom_count_incr(bloom_filter f, const long long *pos)
+{
+	int i;
+
+	for (i = 0; i < BLOOM_PROBES; i++) {
+		if (bloom_count(f, pos[i]) < BLOOM_COUNT_MAX) {
+			bloom_count_add(f, pos[i], 1);
+		}
+	}
+}
+
 /* Add elm into the given bloom filter*/
 void
 bloom_add(bloom_filter f,
 		  long long elm /* the element to be added (a RK hash value) */)
 {
-	/* Your code here */
+	long long pos[BLOOM_PROBES];
+
+	bloom_positions(f, elm, pos);
+	if (f.layout == BLOOM_COUNTING) {
+		bloom_count_incr(f, pos);
+	} else {
+		bloom_set_bits(f, pos);
+	}
+}
+
+/* Add elm into the given bloom filter, which other threads may be adding
+   to at the same time: each bit is set with an atomic fetch-or on its byte,
+   so the bitmap ends up as bloom_add of the same elements in any order 
+   would leave it. Not for the counting layout. */
+void
+bloom_add_concurrent(bloom_filter f,
+                     long long elm /* the element to be added (a RK hash value) */)
+{
+	int i;
+	long long pos[BLOOM_PROBES];
+
+	assert(f.layout != BLOOM_COUNTING);
+	bloom_positions(f, elm, pos);
+	for (i = 0; i < BLOOM_PROBES; i++) {
+		__atomic_fetch_or(&f.buf[pos[i] >> 3], (char)(0x80 >> (pos[i] & 7)), __ATOMIC_RELAXED);
+	}
+}
+
+/* Remove elm from the counting bloom filter f. elm must have been added
+   (and not removed since), or the filter may lose other elements. A 
+   counter that saturated no longer knows how many elements it counts, 
+   so it is left as it is, and the elements on it stay probably present. */
+void
+bloom_remove(bloom_filter f,
+             long long elm /* the element to be removed (a RK hash value) */)
+{
+	int i, c;
+	long long pos[BLOOM_PROBES];
+
+	assert(f.layout == BLOOM_COUNTING);
+	bloom_positions(f, elm, pos);
+	for (i = 0; i < BLOOM_PROBES; i++) {
+		c = bloom_count(f, pos[i]);
+		if (c > 0 && c < BLOOM_COUNT_MAX) {
+			bloom_count_add(f, pos[i], -1);
+		}
+	}
+}
+
+/* Compute the hashes of the n elements elems[] into h1[] and h2[], in a 
+   loop of their own: the two reductions by constant primes of one element
+   do not depend on those of another, so they overlap (and vectorize), 
+   where they would wait on the filter's memory accesses if each were 
+   computed as its element is probed. */
+static inline void
+bloom_hashes_many(const long long *elems, size_t n, unsigned int *h1, unsigned int *h2)
+{
+	size_t j;
+
+	for (j = 0; j < n; j++) {
+		bloom_hashes(elems[j], &h1[j], &h2[j]);
+	}
+}
+
+/* Add the n elements elems[] into the given bloom filter. They are taken
+   BLOOM_MANY_CHUNK at a time: their hashes first (bloom_hashes_many), then
+   their probes, in a loop of the filter's layout. */
+void
+bloom_add_many(bloom_filter f, const long long *elems, size_t n)
+{
+	unsigned int h1[BLOOM_MANY_CHUNK], h2[BLOOM_MANY_CHUNK];
+	long long pos[BLOOM_PROBES];
+	size_t j0, j, cnt;
+
+	for (j0 = 0; j0 < n; j0 += cnt) {
+		cnt = (n - j0 < BLOOM_MANY_CHUNK) ? n - j0 : BLOOM_MANY_CHUNK;
+		bloom_hashes_many(elems + j0, cnt, h1, h2);
+		if (f.layout == BLOOM_COUNTING) {
+			for (j = 0; j < cnt; j++) {
+				bloom_positions_h(f, elems[j0 + j], h1[j], h2[j], pos);
+				bloom_count_incr(f, pos);
+			}
+		} else {
+			for (j = 0; j < cnt; j++) {
+				bloom_positions_h(f, elems[j0 + j], h1[j], h2[j], pos);
+				bloom_set_bits(f, pos);
+			}
+		}
+	}
 }
 
 /* Query if elm is a probably in the given bloom filter */ 
@@ -49,17 +403,64 @@ int
 bloom_query(bloom_filter f,
 			long long elm /* the query element (a RK hash value) */ )
 {
+	unsigned int h1, h2;
 
-	/* Your code here */
-	return 0;
+	bloom_hashes(elm, &h1, &h2);
+	if (f.layout == BLOOM_BLOCKED) {
+		return bloom_test_blocked(f, elm, h1, h2);
+	}
+	if (f.layout == BLOOM_COUNTING) {
+		return bloom_test_counting(f, h1, h2);
+	}
+	return bloom_test_classic(f, h1, h2);
+}
+
+/* Query each of the n elements elems[] in the given bloom filter, and set 
+   bit j of the bitmap result (of (n+7)/8 bytes, with bits in the same order
+   as in the filter, i.e. result[j>>3] & (0x80 >> (j&7))) if elems[j] is
+   probably in it. The elements are taken BLOOM_MANY_CHUNK at a time like
+   in bloom_add_many, and each layout has its own probe loop, so the layout 
+   is dispatched on once per chunk rather than per element. */
+void
+bloom_query_many(bloom_filter f, const long long *elems, size_t n, unsigned char *result)
+{
+	unsigned int h1[BLOOM_MANY_CHUNK], h2[BLOOM_MANY_CHUNK];
+	size_t j0, j, cnt;
+	int hit;
+
+	memset(result, 0, (n + 7) >> 3);
+	for (j0 = 0; j0 < n; j0 += cnt) {
+		cnt = (n - j0 < BLOOM_MANY_CHUNK) ? n - j0 : BLOOM_MANY_CHUNK;
+		bloom_hashes_many(elems + j0, cnt, h1, h2);
+		switch (f.layout) {
+			case BLOOM_BLOCKED:
+				for (j = 0; j < cnt; j++) {
+					hit = bloom_test_blocked(f, elems[j0 + j], h1[j], h2[j]);
+					result[(j0 + j) >> 3] |= (unsigned char)(hit << (7 - ((j0 + j) & 7)));
+				}
+				break;
+			case BLOOM_COUNTING:
+				for (j = 0; j < cnt; j++) {
+					hit = bloom_test_counting(f, h1[j], h2[j]);
+					result[(j0 + j) >> 3] |= (unsigned char)(hit << (7 - ((j0 + j) & 7)));
+				}
+				break;
+			default:
+				for (j = 0; j < cnt; j++) {
+					hit = bloom_test_classic(f, h1[j], h2[j]);
+					result[(j0 + j) >> 3] |= (unsigned char)(hit << (7 - ((j0 + j) & 7)));
+				}
+				break;
+		}
+	}
 }
 
 void 
 bloom_free(bloom_filter *f)
 {
-	free(f->buf);
+	huge_free(f->buf, bloom_bytes(*f));
 	f->buf = NULL;
-    f->bsz = 0;
+	f->bsz = 0;
 }
 
 
@@ -72,7 +473,7 @@ bloom_print(bloom_filter f,
 
 	assert(count % 8 == 0);
 
-	for(i=0; i< (f.bsz>>3) && i < (count>>3); i++) {
+	for(i=0; i< bloom_bytes(f) && i < (count>>3); i++) {
 		printf("%02x ", (unsigned char)(f.buf[i]));
 	}
 	printf("\n");
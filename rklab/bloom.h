@@ -7,15 +7,41 @@
 #include <string.h>
 #include <assert.h>
 
+/* bit layouts of a bloom filter bitmap */
+enum bloom_layout { 
+	BLOOM_CLASSIC=0, /* probes spread over the whole bitmap, big-endian bits */
+	BLOOM_BLOCKED,   /* all probes of one element within one BLOOM_BLOCK_BITS block */
+	BLOOM_COUNTING   /* classic probes into 4-bit counters, so elements can be removed */
+};
+
+/* size of one block of a blocked bloom filter in bits (one 64-byte cache line) */
+#define BLOOM_BLOCK_BITS 512
+
+/* a counter of a counting bloom filter saturates at this value, and then stays there */
+#define BLOOM_COUNT_MAX 15
+
 typedef struct {
-	char *buf; /* the bitmap representing the bloom filter*/
-	int bsz; /* size of bitmap in bits*/
+	char *buf; /* the bitmap representing the bloom filter (the counters of BLOOM_COUNTING)*/
+	long long bsz; /* size of bitmap in bits (number of counters of BLOOM_COUNTING)*/
+	int layout; /* one of enum bloom_layout */
 } bloom_filter;
 
-bloom_filter bloom_init(int bsz);
+/* the number of bits set (counters raised) for each element */
+extern const int BLOOM_HASH_NUM;
+
+bloom_filter bloom_init(long long bsz);
+bloom_filter bloom_init_blocked(long long bsz);
+bloom_filter bloom_init_counting(long long bsz);
 void bloom_free(bloom_filter *f);
+long long bloom_bits(long long n, double fp);
+long long bloom_bytes(bloom_filter f);
 
 void bloom_add(bloom_filter f, long long elm);
+void bloom_add_concurrent(bloom_filter f, long long elm);
+void bloom_remove(bloom_filter f, long long elm);
 int bloom_query(bloom_filter f, long long elm);
+void bloom_add_many(bloom_filter f, const long long *elems, size_t n);
+void bloom_query_many(bloom_filter f, const long long *elems, size_t n, unsigned char *result);
+void bloom_prefetch(bloom_filter f, long long elm);
 
 void bloom_print(bloom_filter f, int count);
@@ -2,16 +2,348 @@
  Author: LT songbin & Christopher Mitchell
  File Name: bloom_test.c
  Description: 
+   ./bloom_test <bitmap_size> <random_num_seed> checks the bloom
+   filter and counts its false positives for random keys, and checks
+   removal from a counting filter (see bloom_remove_check);
+   ./bloom_test -b [n_elements] [seed] benchmarks each layout
+   over a sweep of sizes (see bloom_bench).
  **********************************************************/
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
 
 #include "bloom.h"
 
+/* the benchmark keys are the RK hashes (base 256 modulo BENCH_PRIME, the
+   prime rkmatch uses by default) of BENCH_K-character chunks of text */
+#define BENCH_K 20
+const long long BENCH_PRIME = 5003943032159437LL;
+
+/* the filter sizes swept, in bits (counters) per element */
+const int bench_bpe[] = {4, 6, 8, 10, 12, 16, 20};
+#define BENCH_NSIZES (int)(sizeof(bench_bpe) / sizeof(bench_bpe[0]))
+
+/* a window of the query text is tested for every BENCH_QUERIES_PER_KEY keys */
+#define BENCH_QUERIES_PER_KEY 4
+
+/* Fill text[0..len) with lowercase words of 2 to 9 letters separated by 
+   single spaces, like a normalized document */
+static void
+bench_text(char *text, long long len)
+{
+	long long i = 0;
+	int w;
+
+	while (i < len) {
+		for (w = 2 + random() % 8; w > 0 && i < len; w--) {
+			/* skewed towards the first letters, as letters are in text */
+			text[i++] = 'a' + (random() % 26) * (random() % 26) / 25;
+		}
+		if (i < len) {
+			text[i++] = ' ';
+		}
+	}
+}
+
+/* the RK hash of the BENCH_K characters s, as rkmatch computes it by default */
+static long long
+bench_hash(const char *s)
+{
+	long long h = 0;
+	int i;
+
+	for (i = 0; i < BENCH_K; i++) {
+		/* h < 2^53, so h*256 does not overflow */
+		h = (h * 256 + (unsigned char)s[i]) % BENCH_PRIME;
+	}
+	return h;
+}
+
+static int
+cmp_ll(const void *a, const void *b)
+{
+	long long x = *(const long long *)a, y = *(const long long *)b;
+
+	return (x < y) ? -1 : (x > y);
+}
+
+static double
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* the cache misses of the benchmark, counted if the kernel lets us */
+static int miss_fd = -1;
+
+static void
+misses_open(void)
+{
+#ifdef __linux__
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = PERF_COUNT_HW_CACHE_MISSES;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	miss_fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+}
+
+/* the cache misses counted so far, or -1 if they are not counted */
+static long long
+misses_read(void)
+{
+	long long v;
+
+	if (miss_fd < 0 || read(miss_fd, &v, sizeof(v)) != sizeof(v)) {
+		return -1;
+	}
+	return v;
+}
+
+/* The false positive rate of a classic filter of m bits holding n elements
+   with h probes each: (1 - e^(-h*n/m))^h. */
+static double
+fp_classic(double n, double m, int h)
+{
+	return pow(1 - exp(-h * n / m), h);
+}
+
+/* The false positive rate of a blocked filter of m bits holding n elements
+   with h probes each: the blocks hold Poisson(n*BLOOM_BLOCK_BITS/m) elements,
+   and a block of i elements is a classic filter of BLOOM_BLOCK_BITS bits. */
+static double
+fp_blocked(double n, double m, int h)
+{
+	double lambda = n * BLOOM_BLOCK_BITS / m;
+	double p = exp(-lambda), fp = 0;
+	int i;
+
+	for (i = 0; i < lambda + 10 * sqrt(lambda) + 20; i++) {
+		fp += p * pow(1 - pow(1 - 1.0 / BLOOM_BLOCK_BITS, (double)h * i), h);
+		p *= lambda / (i + 1);
+	}
+	return fp;
+}
+
+/* print the cache misses per operation over n operations, or - if not counted */
+static void
+print_misses(long long before, long long after, long long n)
+{
+	if (before < 0 || after < 0) {
+		printf(" %9s", "-");
+	} else {
+		printf(" %9.2f", (double)(after - before) / n);
+	}
+}
+
+/* Benchmark the bloom filter layouts (classic, blocked and counting) for 
+   n keys over the sizes bench_bpe[]: for each, print the time and the 
+   cache misses per insert and per query, the false positive rate achieved
+   on the query windows that are not keys, and the rate theory predicts 
+   for BLOOM_HASH_NUM probes (and for the best number of probes at that 
+   size, which make bloombench compares against builds with other counts).
+   The keys are the hashes of the chunks of one text and the queries the 
+   hashes of every window of another, as RKBATCH inserts and queries them. */
+static int
+bloom_bench(long long n, unsigned int seed)
+{
+	static const char *layout_names[] = {"classic", "blocked", "counting"};
+	long long *keys, *queries;
+	unsigned char *present;
+	char *text;
+	long long nkeys = 0, nq = n * BENCH_QUERIES_PER_KEY, len, i, j, negatives, fps;
+	long long m0, m1, m2;
+	double t0, t1, t2, theory, best;
+	int layout, s, h;
+	bloom_filter bf;
+
+	srandom(seed);
+	keys = (long long *)malloc(sizeof(long long) * n);
+	queries = (long long *)malloc(sizeof(long long) * nq);
+	present = (unsigned char *)malloc((nq + 7) / 8);
+	len = (nq > n * BENCH_K ? nq : n * BENCH_K) + BENCH_K;
+	text = (char *)malloc(len);
+	if (!keys || !queries || !present || !text) {
+		fprintf(stderr, " failed to allocate the benchmark keys. No memory\n");
+		exit(1);
+	}
+
+	/* distinct chunk hashes of one text, in text order */
+	while (nkeys < n) {
+		bench_text(text, n * BENCH_K);
+		for (i = 0; i + BENCH_K <= n * BENCH_K && nkeys < n; i += BENCH_K) {
+			keys[nkeys++] = bench_hash(text + i);
+		}
+		qsort(keys, nkeys, sizeof(long long), cmp_ll);
+		for (i = j = 0; i < nkeys; i++) {
+			if (j == 0 || keys[i] != keys[j - 1]) {
+				keys[j++] = keys[i];
+			}
+		}
+		nkeys = j;
+	}
+	/* the windows of another text, and how many of them are not keys */
+	bench_text(text, nq + BENCH_K);
+	negatives = 0;
+	for (i = 0; i < nq; i++) {
+		queries[i] = bench_hash(text + i);
+		negatives += !bsearch(&queries[i], keys, nkeys, sizeof(long long), cmp_ll);
+	}
+	/* insert the keys in a random order, not sorted */
+	for (i = nkeys - 1; i > 0; i--) {
+		j = random() % (i + 1);
+		m0 = keys[i];
+		keys[i] = keys[j];
+		keys[j] = m0;
+	}
+
+	misses_open();
+	printf("%lld keys, %lld queries (%lld not keys), %d probes per key\n", 
+	       nkeys, nq, negatives, BLOOM_HASH_NUM);
+	printf("%-9s %4s %10s %9s %10s %9s %10s %10s %5s %10s\n", "layout", "bpe", 
+	       "insert_ns", "ins_miss", "query_ns", "qry_miss", "fp", "fp_theory", "h_opt", "fp_opt");
+	for (layout = 0; layout < 3; layout++) {
+		for (s = 0; s < BENCH_NSIZES; s++) {
+			if (layout == BLOOM_BLOCKED) {
+				bf = bloom_init_blocked(((nkeys * bench_bpe[s] + 7) >> 3) << 3);
+			} else if (layout == BLOOM_COUNTING) {
+				bf = bloom_init_counting(((nkeys * bench_bpe[s] + 7) >> 3) << 3);
+			} else {
+				bf = bloom_init(((nkeys * bench_bpe[s] + 7) >> 3) << 3);
+			}
+
+			m0 = misses_read();
+			t0 = now_ns();
+			bloom_add_many(bf, keys, nkeys);
+			t1 = now_ns();
+			m1 = misses_read();
+			bloom_query_many(bf, queries, nq, present);
+			t2 = now_ns();
+			m2 = misses_read();
+
+			fps = 0;
+			for (i = 0; i < nq; i++) {
+				if ((present[i >> 3] & (0x80 >> (i & 7))) && 
+				    !bsearch(&queries[i], keys, nkeys, sizeof(long long), cmp_ll)) {
+					fps++;
+				}
+			}
+
+			/* the best number of probes for this size, and its rate */
+			h = (int)floor(bench_bpe[s] * log(2) + 0.5);
+			h = (h < 1) ? 1 : h;
+			if (layout == BLOOM_BLOCKED) {
+				theory = fp_blocked(nkeys, bf.bsz, BLOOM_HASH_NUM);
+				best = fp_blocked(nkeys, bf.bsz, h);
+			} else {
+				theory = fp_classic(nkeys, bf.bsz, BLOOM_HASH_NUM);
+				best = fp_classic(nkeys, bf.bsz, h);
+			}
+
+			printf("%-9s %4d %10.1f", layout_names[layout], bench_bpe[s], (t1 - t0) / nkeys);
+			print_misses(m0, m1, nkeys);
+			printf(" %10.1f", (t2 - t1) / nq);
+			print_misses(m1, m2, nq);
+			printf(" %10.6f %10.6f %5d %10.6f\n", negatives ? (double)fps / negatives : 0.0, 
+			       theory, h, best);
+			bloom_free(&bf);
+		}
+	}
+
+	free(keys);
+	free(queries);
+	free(present);
+	free(text);
+	return 0;
+}
+
+/* a random element, as main draws them */
+static long long
+random_elm(void)
+{
+	long long rll = (long long) random();
+
+	return rll << 31 | random();
+}
+
+/* Check bloom_remove on counting filters of bsz counters: add n random 
+   elements, remove every other one, and check that the survivors are all
+   still present and that a removed element is only present if a filter 
+   holding just the survivors has it too (a collision with them). Then 
+   check that an element added often enough to saturate its counters stays
+   present however often it is removed. Print nothing unless a check fails. */
+static void
+bloom_remove_check(int bsz, int n)
+{
+	bloom_filter cf, ref;
+	long long *elms, x;
+	int i;
+
+	elms = (long long *)malloc(sizeof(long long) * (n > 0 ? n : 1));
+	if (!elms) {
+		fprintf(stderr, " failed to allocate %d elements. No memory\n", n);
+		exit(1);
+	}
+	cf = bloom_init_counting(bsz);
+	ref = bloom_init_counting(bsz);
+	for (i = 0; i < n; i++) {
+		elms[i] = random_elm();
+		bloom_add(cf, elms[i]);
+		if (i % 2 == 0) {
+			bloom_add(ref, elms[i]);
+		}
+	}
+	for (i = 1; i < n; i += 2) {
+		bloom_remove(cf, elms[i]);
+	}
+	for (i = 0; i < n; i++) {
+		if (i % 2 == 0 && !bloom_query(cf, elms[i])) {
+			printf("%lld not removed, but not present according to bloom_query\n", elms[i]);
+			exit(1);
+		}
+		if (i % 2 == 1 && bloom_query(cf, elms[i]) && !bloom_query(ref, elms[i])) {
+			printf("%lld removed, but still present without colliding with the others\n", elms[i]);
+			exit(1);
+		}
+	}
+	bloom_free(&cf);
+	bloom_free(&ref);
+
+	/* a saturated counter no longer counts, so it never goes down */
+	cf = bloom_init_counting(bsz);
+	x = random_elm();
+	for (i = 0; i <= BLOOM_COUNT_MAX; i++) {
+		bloom_add(cf, x);
+	}
+	for (i = 0; i <= BLOOM_COUNT_MAX + 1; i++) {
+		bloom_remove(cf, x);
+	}
+	if (!bloom_query(cf, x)) {
+		printf("%lld saturated its counters, but not present after removing it\n", x);
+		exit(1);
+	}
+	bloom_free(&cf);
+	free(elms);
+}
+
 int
 main(int argc, char **argv)
 {
@@ -20,12 +352,17 @@ main(int argc, char **argv)
 	long long rll;
 	int n_inserted;
 	long long *testnums;
+	unsigned char *present;
 	int matched  = 0;
 	int i;
+	int round;
 	
 
+	if (argc > 1 && strcmp(argv[1], "-b") == 0) {
+		return bloom_bench(argc > 2 ? atoll(argv[2]) : 1 << 20, argc > 3 ? atoi(argv[3]) : 1);
+	}
 	if(argc < 2) {
-		printf("Usage:\n ./bloom_test <bitmap_size> <random_num_seed>\n");
+		printf("Usage:\n ./bloom_test <bitmap_size> <random_num_seed>\n ./bloom_test -b [n_elements] [seed]\n");
 		exit(1);
 	}
 
@@ -38,6 +375,7 @@ main(int argc, char **argv)
 
 	n_inserted = bsz/10;
 	testnums = (long long *)malloc(sizeof(long long)*n_inserted);
+	present = (unsigned char *)malloc((n_inserted + 7)/8);
 
 
 	/*generate n_inserted random numbers (of long long type)
@@ -47,25 +385,32 @@ main(int argc, char **argv)
 		rll = (long long) random();
 		rll = rll << 31 | random();
 		testnums[i] = rll;
-		bloom_add(bf, rll);
 	}
+	bloom_add_many(bf, testnums, n_inserted);
 
 	/*check if all the n_inserted numbers are present in the 
-	  bloom filter using bloom_query*/
+	  bloom filter using bloom_query_many*/
+	bloom_query_many(bf, testnums, n_inserted, present);
 	for (i = 0; i < n_inserted; i++) {
-		if (!bloom_query(bf, testnums[i])) {
+		if (!(present[i >> 3] & (0x80 >> (i & 7)))) {
 			printf("%lld inserted, but not present according to bloom_query\n", testnums[i]);
 			exit(1);
 		}
 	}
 
 	/*generate n_inserted*100 random numbers and check if any of them is 
-	  in the bloom filter*/
-	for (i = 0; i < n_inserted*100; i++) {
-		rll = (long long) random();
-		rll = rll << 31 | random();
-		if (bloom_query(bf, rll)) {
-			matched++;
+	  in the bloom filter, n_inserted at a time*/
+	for (round = 0; round < 100; round++) {
+		for (i = 0; i < n_inserted; i++) {
+			rll = (long long) random();
+			rll = rll << 31 | random();
+			testnums[i] = rll;
+		}
+		bloom_query_many(bf, testnums, n_inserted, present);
+		for (i = 0; i < n_inserted; i++) {
+			if (present[i >> 3] & (0x80 >> (i & 7))) {
+				matched++;
+			}
 		}
 	}
 
@@ -74,6 +419,9 @@ main(int argc, char **argv)
 	/* print the first 1024 bits of bloom filter*/
 	bloom_print(bf, 1024);
 
+	/* removal from a counting filter of the same size (silent if it works) */
+	bloom_remove_check(bsz, n_inserted);
+
 	return 0;
 }
 
@@ -0,0 +1,151 @@
+/***********************************************************
+ File Name: pool.c
+ Description: implementation of a fork-join thread pool.
+   pool_run hands the tasks of one job out to the pool's threads 
+   and the calling thread, and returns once all of them are done.
+ **********************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "pool.h"
+
+/* the worker number of this thread while it runs a task, -1 otherwise */
+static __thread int pool_current = -1;
+
+/* take tasks of the current job until there are none left; 
+   called and returns with p->lock held */
+static void
+pool_work(thread_pool *p, int worker)
+{
+	long long task;
+	pool_fn fn;
+	void *ctx;
+	int outer = pool_current;
+
+	while (p->next < p->ntasks) {
+		task = p->next++;
+		fn = p->fn;
+		ctx = p->ctx;
+
+		pthread_mutex_unlock(&p->lock);
+		pool_current = worker;
+		fn(ctx, task, worker);
+		pool_current = outer;
+		pthread_mutex_lock(&p->lock);
+
+		if (++p->ndone == p->ntasks) {
+			pthread_cond_signal(&p->done);
+		}
+	}
+}
+
+typedef struct {
+	thread_pool *p;
+	int worker;
+} pool_arg;
+
+static void *
+pool_thread(void *arg)
+{
+	thread_pool *p = ((pool_arg *)arg)->p;
+	int worker = ((pool_arg *)arg)->worker;
+
+	free(arg);
+	pthread_mutex_lock(&p->lock);
+	while (!p->quit) {
+		pool_work(p, worker);
+		if (!p->quit) {
+			pthread_cond_wait(&p->work, &p->lock);
+		}
+	}
+	pthread_mutex_unlock(&p->lock);
+	return NULL;
+}
+
+/* Start a pool in which nthreads threads (counting the one that will call
+   pool_run) work on each job */
+void
+pool_init(thread_pool *p, int nthreads)
+{
+	int i;
+	pool_arg *arg;
+
+	p->nthreads = (nthreads > 0) ? nthreads : 1;
+	p->fn = NULL;
+	p->ctx = NULL;
+	p->ntasks = p->next = p->ndone = 0;
+	p->quit = 0;
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->work, NULL);
+	pthread_cond_init(&p->done, NULL);
+
+	p->threads = (pthread_t *)malloc(sizeof(pthread_t) * p->nthreads);
+	if (!p->threads) {
+		fprintf(stderr, " failed to allocate %d threads. No memory\n", p->nthreads);
+		exit(1);
+	}
+	for (i = 1; i < p->nthreads; i++) {
+		arg = (pool_arg *)malloc(sizeof(pool_arg));
+		if (!arg) {
+			fprintf(stderr, " failed to allocate thread arguments. No memory\n");
+			exit(1);
+		}
+		arg->p = p;
+		arg->worker = i;
+		if (pthread_create(&p->threads[i], NULL, pool_thread, arg) != 0) {
+			perror("pool_init: pthread_create ");
+			exit(1);
+		}
+	}
+}
+
+void
+pool_free(thread_pool *p)
+{
+	int i;
+
+	pthread_mutex_lock(&p->lock);
+	p->quit = 1;
+	pthread_cond_broadcast(&p->work);
+	pthread_mutex_unlock(&p->lock);
+
+	for (i = 1; i < p->nthreads; i++) {
+		pthread_join(p->threads[i], NULL);
+	}
+	free(p->threads);
+	p->threads = NULL;
+	pthread_mutex_destroy(&p->lock);
+	pthread_cond_destroy(&p->work);
+	pthread_cond_destroy(&p->done);
+}
+
+/* Run fn(ctx, task, worker) for every task in 0..ntasks-1 on the pool and
+   wait for all of them to complete. Tasks may run in any order. A task 
+   that calls pool_run runs all tasks of the inner job itself, in order, 
+   as the worker it is. */
+void
+pool_run(thread_pool *p, pool_fn fn, void *ctx, long long ntasks)
+{
+	long long task;
+
+	if (pool_current >= 0) {
+		for (task = 0; task < ntasks; task++) {
+			fn(ctx, task, pool_current);
+		}
+		return;
+	}
+	pthread_mutex_lock(&p->lock);
+	p->fn = fn;
+	p->ctx = ctx;
+	p->ntasks = ntasks;
+	p->next = 0;
+	p->ndone = 0;
+	pthread_cond_broadcast(&p->work);
+
+	pool_work(p, 0);
+	while (p->ndone < p->ntasks) {
+		pthread_cond_wait(&p->done, &p->lock);
+	}
+	pthread_mutex_unlock(&p->lock);
+}
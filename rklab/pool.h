@@ -0,0 +1,29 @@
+/***********************************************************
+ File Name: pool.h
+ Description: definition of a fork-join thread pool
+ **********************************************************/
+#include <pthread.h>
+
+/* a task function: run task number 'task' of a job on behalf of worker
+   'worker' (0 is the thread that called pool_run, 1..nthreads-1 the pool's
+   own threads), so that ctx can keep per-worker scratch space */
+typedef void (*pool_fn)(void *ctx, long long task, int worker);
+
+typedef struct {
+	pthread_t *threads;    /* the nthreads-1 worker threads */
+	int nthreads;          /* number of threads working on a job, including the caller */
+	pthread_mutex_t lock;  /* protects everything below */
+	pthread_cond_t work;   /* signalled when a job is posted or the pool shuts down */
+	pthread_cond_t done;   /* signalled when the last task of a job completes */
+	pool_fn fn;            /* the current job */
+	void *ctx;
+	long long ntasks;      /* number of tasks in the current job */
+	long long next;        /* next task to hand out */
+	long long ndone;       /* number of tasks completed */
+	int quit;              /* set by pool_free */
+} thread_pool;
+
+void pool_init(thread_pool *p, int nthreads);
+void pool_free(thread_pool *p);
+
+void pool_run(thread_pool *p, pool_fn fn, void *ctx, long long ntasks);
@@ -0,0 +1,87 @@
+/***********************************************************
+ File Name: rkgen.c
+ Description: write a random document for benchmarking rkmatch 
+   to stdout, generated the way rktest.py's get_rand_string 
+   (and, with -d, get_denormalized) does
+ **********************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/* xorshift64*, so that large documents are quick to generate */
+unsigned long long rng_state = 88172645463325252ULL;
+
+unsigned long long
+rng_next(void)
+{
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 2685821657736338717ULL;
+}
+
+/* a random number in [0, 1) */
+double
+rng_real(void)
+{
+	return (rng_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+int
+main(int argc, char **argv)
+{
+	long long size, slen = 0;
+	int wlen = 0;
+	int denormalize = 0;
+	int prev = ' ';
+	int c, j;
+
+	while ((c = getopt(argc, argv, "dr:")) != -1) {
+		switch (c) 
+		{
+			case 'd':
+				denormalize = 1;
+				break;
+			case 'r':
+				rng_state += (unsigned long long)atoll(optarg) * 0x9e3779b97f4a7c15ULL;
+				break;
+			default:
+				fprintf(stderr, "Valid options are: -d (denormalize) -r <random seed>\n");
+				exit(1);
+		}
+	}
+	if (argc - optind < 1) {
+		printf("Usage: ./rkgen [-d] [-r seed] size\n");
+		exit(1);
+	}
+	size = atoll(argv[optind]);
+
+	/* words of up to 15 lowercase letters separated by single spaces */
+	while (slen < size) {
+		if ((rng_real() < 0.1 || wlen > 14) && prev != ' ') {
+			prev = ' ';
+			wlen = 0;
+		} else {
+			prev = 'a' + (int)(rng_next() % 26);
+			wlen++;
+		}
+		slen++;
+
+		if (!denormalize) {
+			putchar(prev);
+			continue;
+		}
+		/* randomly uppercase, and widen each space with a tab and up to 3 more spaces */
+		putchar((rng_real() < 0.5) ? prev : (prev == ' ' ? ' ' : prev - 'a' + 'A'));
+		if (prev == ' ') {
+			putchar('\t');
+			for (j = 0; j < 3; j++) {
+				if (rng_real() < 0.5) {
+					putchar(' ');
+				}
+			}
+		}
+	}
+	return 0;
+}
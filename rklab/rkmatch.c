@@ -3,6 +3,54 @@
 
 	 ./rkmatch snippet_size query_doc doc1 [doc2...]
 
+	 A doc named - is read from the standard input; with -s <block size>,
+	 RKBATCH streams it in blocks instead of reading it in whole.
+	 With -j <threads>, RKBATCH scans the docs on that many threads.
+	 With -T, the time and throughput of each phase are printed to stderr.
+	 With --stats, they are written as JSON to stderr, or with 
+	 --stats=<file> to that file (- is stdout), along with counts of the windows RKBATCH
+	 probed, passed through its bloom filter, found a chunk hash for and 
+	 verified, and the hardware perf counters of the run if available.
+	 With -i 1, RKBATCH looks chunks up in an exact hash table instead of
+	 behind a bloom filter (and prints no bloom bits); -i 2 puts a small 
+	 bloom filter, sized for the false positive rate -e (0.01), in front 
+	 of that table.
+	 With -o <index file>, RKBATCH also saves the index it builds from 
+	 query_doc; with -l <index file>, it maps a saved index instead, and 
+	 there is no query_doc argument:
+
+	 ./rkmatch -t 3 -l index_file doc1 [doc2...]
+
+	 An index file can grow without being rebuilt: with -A <index file>, 
+	 RKBATCH appends the index of query_doc to it as a new segment (with the
+	 chunk length and settings of the file, if it exists) and matches the 
+	 docs against all of its segments. With -l, -L lists the segments, 
+	 -X <n> deletes segment n and -C compacts the live ones into one, which
+	 also happens in the background once -A leaves more than 
+	 INDEX_MAX_SEGMENTS; the docs are then optional:
+
+	 ./rkmatch -t 3 -A index_file query_doc [doc1...]
+	 ./rkmatch -t 3 -l index_file [-L] [-X n] [-C] [doc1...]
+
+	 -t 4 (WINNOW) compares only the winnowing fingerprints of query_doc 
+	 and each doc, the smallest k-gram hash of every -w (8) consecutive ones.
+	 -t 5 (CORPUS) has no query_doc; it compares the winnowed docs with 
+	 each other through one inverted index, and prints the similarity 
+	 matrix, or with -K <n> the n most similar pairs, of at most 
+	 CORPUS_MAX_DOCS docs:
+
+	 ./rkmatch -t 5 [-K n] doc1 doc2 [doc3...]
+
+	 With -m <region file>, RKBATCH also writes where each doc matches the 
+	 query, as maximal (query offset, doc offset, length) regions grown from
+	 the chunk matches, in NDJSON or with -M 1 in binary (see region_writer).
+	 With -O, the offsets and lengths are into the original files rather than
+	 the normalized text.
+
+	 -t auto picks SIMPLE or RKBATCH from the sizes of query_doc and the 
+	 docs, and for RKBATCH the hash family, index type and number of threads
+	 that -f, -i and -j leave open (see auto_select).
+
 */
 
 #include <stdio.h>
@@ -11,21 +59,255 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <string.h>
 #include <strings.h>
+#include <ctype.h>
 #include <assert.h>
 #include <time.h>
+#include <pthread.h>
+#include <getopt.h>
+#include <errno.h>
+#include <stddef.h>
+#include <sys/file.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+#if defined(__i386__) || defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #include "bloom.h"
+#include "pool.h"
+#include "arena.h"
 
-enum algotype { EXACT=0, SIMPLE, RK, RKBATCH};
+enum algotype { AUTO=-1, EXACT=0, SIMPLE, RK, RKBATCH, WINNOW, CORPUS};
+const char *algo_names[] = {"exact", "simple", "rk", "rkbatch", "winnow", "corpus"};
+
+/* hash families for the RK rolling hash:
+   HASH_MOD is base 256 modulo BIG_PRIME (the reference output),
+   HASH_M61 is base 256 modulo the Mersenne prime 2^61-1,
+   HASH_W64 is base W64_BASE with 2^64 wraparound */
+enum hashtype { HASH_MOD=0, HASH_M61, HASH_W64};
+int which_hash = HASH_MOD;
 
 /* a large prime for RK hash (BIG_PRIME*256 does not overflow)*/
 long long BIG_PRIME = 5003943032159437; 
 
+/* the Mersenne prime 2^61-1 used by HASH_M61 */
+#define M61 ((1ULL << 61) - 1)
+
+/* odd multiplier used by HASH_W64 (an even base would shift characters out of the hash) */
+#define W64_BASE 0x100000001b3ULL
+
 /* constants used for printing debug information */
 const int PRINT_RK_HASH = 5;
 const int PRINT_BLOOM_BITS = 160;
 
+/* bloom filter layout used by RKBATCH; -1 picks BLOOM_BLOCKED once the bitmap
+   is larger than BLOOM_BLOCKED_MIN_BITS and BLOOM_CLASSIC otherwise. 
+   BLOOM_COUNTING (-b 2) is probed like BLOOM_CLASSIC in 4 times the memory. */
+int bloom_layout = -1;
+const int BLOOM_BLOCKED_MIN_BITS = 256*1024*8;
+
+/* how RKBATCH looks up a target window among the query chunks:
+   INDEX_BLOOM passes it through the bloom filter and then binary-searches 
+   the sorted chunks (the reference output, with the bloom bits printed),
+   INDEX_TABLE probes an open-addressing hash table of the chunks directly,
+   INDEX_FILTERED probes the table only for the windows that pass a small
+   blocked bloom filter, sized for a false positive rate of filter_fp */
+enum indextype { INDEX_BLOOM=0, INDEX_TABLE, INDEX_FILTERED};
+int index_type = INDEX_BLOOM;
+double filter_fp = 0.01;
+
+/* WINNOW keeps the smallest of every winnow_w consecutive k-gram hashes */
+int winnow_w = 8;
+
+/* CORPUS prints the corpus_top most similar pairs of docs, or the whole 
+   similarity matrix if corpus_top is 0 */
+int corpus_top = 0;
+
+/* CORPUS keeps a count for every pair of docs, and with -K a doc_pair too,
+   so it compares at most CORPUS_MAX_DOCS docs: 64 MB of counts, and 192 MB
+   of pairs with -K */
+#define CORPUS_MAX_DOCS 4096
+
+/* costs -t auto weighs SIMPLE against RKBATCH with, in nanoseconds per byte
+   as measured by make calibrate on a release build: SIMPLE passes over every
+   doc byte once per query chunk, RKBATCH indexes every query byte once and
+   scans every doc byte once (with the W64 hash and the chunk table). */
+double auto_simple_ns = 0.1;
+double auto_index_ns = 12.0;
+double auto_scan_ns = 18.0;
+
+/* -t auto looks chunks up in the table alone while it is at most this big, 
+   and puts a bloom filter in front of it (INDEX_FILTERED) beyond */
+const long long AUTO_TABLE_MAX = 256*1024;
+
+/* number of target windows whose index lookups RKBATCH overlaps */
+#define PROBE_BATCH 16
+
+/* most chunk lengths RKBATCH matches with in one pass (-k 10,20,40) */
+#define MULTI_K_MAX 8
+
+/* with several chunk lengths, the prefix hashes of the doc are computed 
+   this many characters at a time, so that they stay in cache while every
+   chunk length takes its windows from them */
+#define MULTI_BLOCK 4096
+
+/* size of the blocks of the arenas documents are loaded into */
+#define DOC_ARENA_BLOCK (1 << 20)
+
+/* with -j, a doc of at least this many bytes is split between the threads */
+const long long PARALLEL_SPLIT_MIN = 4*1024*1024;
+
+/* with -j, batch_index_build shares the work of a query of at least 
+   BUILD_PARALLEL_MIN chunks with the threads of work_pool, and 
+   normalize_into that of a document of at least NORMALIZE_PARALLEL_MIN bytes */
+thread_pool *work_pool = NULL;
+const long long BUILD_PARALLEL_MIN = 64*1024;
+const long long NORMALIZE_PARALLEL_MIN = 1024*1024;
+
+
+/* phases timed with -T and --stats; read and normalize cover the query and 
+   every doc, verify is the part of the RKBATCH scan spent comparing windows
+   with the chunks whose hash they carry */
+enum phase { PH_READ=0, PH_NORMALIZE, PH_INDEX, PH_SCAN, PH_VERIFY, NPHASES};
+const char *phase_names[NPHASES] = {"read", "normalize", "index", "scan", "verify"};
+int timing = 0;
+long long phase_ns[NPHASES];    /* nanoseconds spent in each phase */
+long long phase_bytes[NPHASES]; /* bytes each phase went through */
+
+/* events counted by the RKBATCH scans for --stats:
+   CT_WINDOWS target windows probed,
+   CT_BLOOM_PASS windows that passed the bloom filter (if there is one),
+   CT_HASH_HITS windows whose hash some chunk carries,
+   CT_VERIFIES byte comparisons of a window with a not yet matched chunk,
+   CT_VERIFIED comparisons that found them equal (chunks newly matched) */
+enum counter { CT_WINDOWS=0, CT_BLOOM_PASS, CT_HASH_HITS, CT_VERIFIES, CT_VERIFIED, NCOUNTERS};
+const char *counter_names[NCOUNTERS] = {"windows", "bloom_positives", "hash_hits", "verifies", "verified"};
+long long counters[NCOUNTERS];
+
+/* with --stats, the timings and counters are written as JSON at the end of
+   the run, to stats_file ("-" is stdout) or to stderr if it is NULL */
+int stats = 0;
+const char *stats_file = NULL;
+
+
+/* a file brought into memory by map_file */
+typedef struct {
+	unsigned char *buf; /* the file content */
+	long long len;      /* length of the file content */
+	int mapped;         /* 1 if buf is mmap()ed, 0 if it was read into malloc()ed memory */
+} file_map;
+
+/* one query chunk of the RKBATCH index: its RK hash and its offset in qs */
+typedef struct {
+	long long hash;
+	long long off;
+} chunk_t;
+
+/* The query side of RKBATCH, built once from the m/k chunks of qs. An 
+   index loaded from a file of several segments (see index_header) is a
+   list of such indexes, one per live segment, that all share k and the 
+   hash family; their match flags lie one after another in one array. */
+typedef struct batch_index {
+	int k;                   /* chunk length */
+	const unsigned char *qs; /* query document the chunks point into */
+	long long nchunks;       /* number of chunks (m/k) */
+	chunk_t *chunks;         /* all chunks, sorted by (hash, off) */
+	bloom_filter bf;         /* bloom filter over all chunk hashes (INDEX_BLOOM, INDEX_FILTERED) */
+	chunk_t *table;          /* open-addressing table of all chunks (INDEX_TABLE, INDEX_FILTERED), or NULL */
+	int table_shift;         /* a hash's home slot is its top 64-table_shift mixed bits */
+	long long base_exp;      /* rk_base_exp(k) */
+	file_map file;           /* the index file all of the above point into (batch_index_load), 
+	                            or buf NULL if they were built in memory */
+	struct batch_index *next; /* the next segment, or NULL */
+	long long chunk_base;    /* offset of this segment's match flags (chunks before it) */
+	long long all_chunks;    /* number of chunks of all segments, in the first one */
+} batch_index;
+
+/* An index file holds a batch index and the normalized query it was built 
+   from, so that later runs can map it instead of building it again. It is 
+   a log of segments, each starting at a multiple of INDEX_ALIGN bytes: 
+   -o writes a file of one data segment, -A appends a data segment built 
+   from another query, -X appends a tombstone that deletes a data segment, 
+   and -C rewrites the file as a single segment of the live ones (as does 
+   a background process once -A leaves more than INDEX_MAX_SEGMENTS).
+   A segment starts with an index_header, whose fields are all 64 bits wide
+   so that -m32 and -m64 builds agree on its layout (it is in the byte order
+   of the machine that wrote it); a data segment follows it with sections 
+   that each start at a multiple of INDEX_ALIGN bytes: the query, the sorted
+   chunks, the bloom bitmap and the chunk table, the last two if the index
+   type has them. All segments of a file have the k, hash family, prime and
+   index type of the first. A version 1 file is a single data segment whose
+   header ends before kind. */
+#define INDEX_MAGIC "RKINDEX"
+#define INDEX_VERSION 2
+#define INDEX_ALIGN 64
+#define INDEX_NAME_LEN 128
+#define INDEX_MAX_SEGMENTS 8
+
+enum segkind { SEG_DATA=0, SEG_TOMBSTONE};
+
+typedef struct {
+	char magic[8];           /* INDEX_MAGIC */
+	long long version;       /* INDEX_VERSION */
+	long long k;             /* chunk length */
+	long long hash;          /* hash family (enum hashtype) */
+	long long prime;         /* BIG_PRIME, for HASH_MOD */
+	long long index_type;    /* enum indextype */
+	long long qlen;          /* length of the normalized query */
+	long long nchunks;       /* number of chunks */
+	long long bloom_bsz;     /* bloom filter size in bits, 0 if none */
+	long long bloom_layout;  /* enum bloom_layout */
+	long long table_shift;   /* the table has 2^(64-table_shift) slots */
+	long long qs_off;        /* offsets of the sections from the segment start, 0 if absent */
+	long long chunks_off;
+	long long bloom_off;
+	long long table_off;
+	long long kind;          /* enum segkind */
+	long long seg_len;       /* length of the segment, a multiple of INDEX_ALIGN */
+	long long target;        /* the number of the data segment a tombstone deletes */
+	char name[INDEX_NAME_LEN]; /* the query doc a data segment was built from */
+} index_header;
+
+/* the rolling state of a batch scan that is fed the target in blocks */
+typedef struct {
+	long long hash; /* RK hash of the last min(seen, k) characters */
+	long long seen; /* number of target characters consumed so far */
+} scan_state;
+
+/* a chunk match credited by a batch scan: the chunk's offset in the query
+   and the target window that matched it */
+typedef struct {
+	long long qoff;
+	const unsigned char *win;
+} hit_t;
+
+/* the chunk matches of a scan, in target order */
+typedef struct {
+	hit_t *hit;
+	long long n;   /* number of matches */
+	long long cap; /* number of matches allocated */
+} hit_list;
+
+/* the counters of one batch scan, kept locally and added to counters[] and 
+   to the verify phase once the scan (or block) is done */
+typedef struct {
+	long long n[NCOUNTERS];
+	long long verify_ns; /* time spent comparing, if phases are timed */
+	hit_list *hits;      /* where to record the chunk matches, or NULL */
+} scan_counters;
+
+/* the whitespace-collapse state normalize_stream carries across blocks */
+typedef struct {
+	int prev_space; /* the last character was whitespace, or there was none yet */
+	int pending;    /* a space is owed to the output if any character follows */
+} norm_state;
 
 long long
 timediff(struct timespec ts, struct timespec ts0)
@@ -33,6 +315,161 @@ timediff(struct timespec ts, struct timespec ts0)
 	return (ts.tv_sec-ts0.tv_sec)*1000000+(ts.tv_nsec-ts0.tv_nsec)/1000;
 }
 
+/* like timediff, in nanoseconds */
+long long
+timediff_ns(struct timespec ts, struct timespec ts0)
+{
+	return (ts.tv_sec-ts0.tv_sec)*1000000000LL+(ts.tv_nsec-ts0.tv_nsec);
+}
+
+struct timespec
+phase_start(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts;
+}
+
+/* Charge the time since ts0 and the bytes gone through to phase ph. 
+   Threads may charge the same phase, so with -j a phase's time is
+   the sum of its time on every thread. */
+void
+phase_end(int ph, struct timespec ts0, long long bytes)
+{
+	if (!timing && !stats) {
+		return;
+	}
+	__sync_fetch_and_add(&phase_ns[ph], timediff_ns(phase_start(), ts0));
+	__sync_fetch_and_add(&phase_bytes[ph], bytes);
+}
+
+/* the throughput of phase ph in MB/s */
+double
+phase_mbps(int ph)
+{
+	return phase_ns[ph] > 0 ? (double)phase_bytes[ph] / phase_ns[ph] * 1e9 / (1 << 20) : 0.0;
+}
+
+/* print the time and throughput of every phase that ran to stderr */
+void
+phase_report(void)
+{
+	int ph;
+
+	for (ph = 0; ph < NPHASES; ph++) {
+		if (phase_bytes[ph] == 0 && phase_ns[ph] == 0) {
+			continue;
+		}
+		fprintf(stderr, "%-10s %12lld us %14lld bytes %10.1f MB/s\n", 
+		        phase_names[ph], phase_ns[ph] / 1000, phase_bytes[ph], phase_mbps(ph));
+	}
+}
+
+#ifdef __linux__
+/* hardware events --stats samples, over the whole run and every thread */
+#define NPERF 4
+const char *perf_names[NPERF] = {"cycles", "instructions", "cache_misses", "branch_misses"};
+const unsigned long long perf_configs[NPERF] = {PERF_COUNT_HW_CPU_CYCLES, 
+    PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+int perf_fd[NPERF] = {-1, -1, -1, -1};
+
+/* Start counting the perf events of this process and of the threads it 
+   creates from now on. An event the kernel does not let us count is left
+   out of the report. */
+void
+perf_open(void)
+{
+	struct perf_event_attr attr;
+	int e;
+
+	for (e = 0; e < NPERF; e++) {
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = perf_configs[e];
+		attr.inherit = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		perf_fd[e] = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+	}
+}
+
+/* write the perf events counted so far as a JSON object, or null if none could be */
+void
+perf_report(FILE *f)
+{
+	long long v;
+	int e, first = 1;
+
+	for (e = 0; e < NPERF; e++) {
+		if (perf_fd[e] < 0 || read(perf_fd[e], &v, sizeof(v)) != sizeof(v)) {
+			continue;
+		}
+		fprintf(f, "%s\"%s\": %lld", first ? "{" : ", ", perf_names[e], v);
+		first = 0;
+	}
+	fprintf(f, first ? "null" : "}");
+}
+#else
+void
+perf_open(void)
+{
+}
+
+void
+perf_report(FILE *f)
+{
+	fprintf(f, "null");
+}
+#endif
+
+/* Write the phase timings and the scan counters of the run to stats_file
+   as one JSON object. wall_ns is the time the whole run took; with -j a 
+   phase's time is summed over the threads and may exceed it.
+   bloom_fp_rate is the fraction of the windows carrying no chunk's hash 
+   that the bloom filter let through, null if there was no filter. */
+void
+stats_report(int algo, int k, int nthreads, int ndocs, long long wall_ns)
+{
+	FILE *f = stderr;
+	int ph, ct;
+	long long windows = counters[CT_WINDOWS];
+	long long misses = windows - counters[CT_HASH_HITS];
+	int filtered = (algo == RKBATCH && index_type != INDEX_TABLE);
+
+	if (stats_file && strcmp(stats_file, "-") == 0) {
+		f = stdout;
+	} else if (stats_file && !(f = fopen(stats_file, "w"))) {
+		perror("rkmatch: stats ");
+		exit(1);
+	}
+	fprintf(f, "{\"algo\": \"%s\", \"k\": %d, \"threads\": %d, \"docs\": %d, \"wall_us\": %lld,\n", 
+	        algo_names[algo], k, nthreads, ndocs, wall_ns / 1000);
+	fprintf(f, " \"phases\": {");
+	for (ph = 0; ph < NPHASES; ph++) {
+		fprintf(f, "%s\n  \"%s\": {\"us\": %lld, \"bytes\": %lld, \"bytes_per_s\": %.0f}", 
+		        ph ? "," : "", phase_names[ph], phase_ns[ph] / 1000, phase_bytes[ph], 
+		        phase_mbps(ph) * (1 << 20));
+	}
+	fprintf(f, "},\n \"counters\": {");
+	for (ct = 0; ct < NCOUNTERS; ct++) {
+		fprintf(f, "%s\n  \"%s\": %lld", ct ? "," : "", counter_names[ct], counters[ct]);
+	}
+	fprintf(f, ",\n  \"bloom_fp_rate\": ");
+	if (filtered && misses > 0) {
+		fprintf(f, "%.6f", (double)(counters[CT_BLOOM_PASS] - counters[CT_HASH_HITS]) / misses);
+	} else {
+		fprintf(f, "null");
+	}
+	fprintf(f, "},\n \"perf\": ");
+	perf_report(f);
+	fprintf(f, "}\n");
+	if (f != stdout && f != stderr) {
+		fclose(f);
+	}
+}
+
 /* modulo addition */
 long long
 madd(long long a, long long b)
@@ -47,26 +484,230 @@ mdel(long long a, long long b)
 	return ((a>b)?(a-b):(a+BIG_PRIME-b));
 }
 
-/* modulo multiplication*/
+/* modulo multiplication, for a, b <= BIG_PRIME <= 2^62 */
 long long
 mmul(long long a, long long b)
 {
-	return ((a*b) % BIG_PRIME);
+#ifdef __SIZEOF_INT128__
+	/* a 128-bit product does not overflow for a large -q prime */
+	return (long long)(((unsigned __int128)a * (unsigned long long)b) % (unsigned long long)BIG_PRIME);
+#else
+	unsigned long long x, r = 0;
+	long long p;
+
+	/* the product of a character or 256 and a hash fits the default prime */
+	if (!__builtin_mul_overflow(a, b, &p)) {
+		return p % BIG_PRIME;
+	}
+	/* a large -q prime, or two large factors: double and add, each sum < 2^63 */
+	x = (unsigned long long)(a % BIG_PRIME);
+	for (; b; b >>= 1) {
+		if (b & 1) {
+			r += x;
+			r = (r >= (unsigned long long)BIG_PRIME) ? r - BIG_PRIME : r;
+		}
+		x += x;
+		x = (x >= (unsigned long long)BIG_PRIME) ? x - BIG_PRIME : x;
+	}
+	return (long long)r;
+#endif
+}
+
+/* reduce x modulo 2^61-1 with shifts and adds, for x < 2^64 */
+static inline unsigned long long
+m61_reduce(unsigned long long x)
+{
+	x = (x & M61) + (x >> 61);
+	return (x >= M61) ? (x - M61) : x;
+}
+
+/* multiplication modulo 2^61-1, for a, b < 2^61 */
+static inline unsigned long long
+m61_mul(unsigned long long a, unsigned long long b)
+{
+#ifdef __SIZEOF_INT128__
+	unsigned __int128 p = (unsigned __int128)a * b;
+	return m61_reduce(((unsigned long long)p & M61) + (unsigned long long)(p >> 61));
+#else
+	/* split into 32-bit halves, using 2^64 = 2^3 and 2^61 = 1 (mod 2^61-1) */
+	unsigned long long a1 = a >> 32, a0 = a & 0xffffffffULL;
+	unsigned long long b1 = b >> 32, b0 = b & 0xffffffffULL;
+	unsigned long long mid = a1*b0 + a0*b1;
+	unsigned long long lo = a0*b0;
+	unsigned long long r = (a1*b1 << 3) + (mid >> 29) + ((mid & ((1ULL << 29) - 1)) << 32);
+	return m61_reduce(m61_reduce(r) + m61_reduce(lo));
+#endif
+}
+
+/* multiply h by 256 modulo 2^61-1, i.e. rotate the 61-bit value left by 8 bits */
+static inline unsigned long long
+m61_shl8(unsigned long long h)
+{
+	return ((h << 8) & M61) | (h >> 53);
+}
+
+/* always inlined, so that a constant hash family (and window length) 
+   passed down to them specializes the loops they are called from */
+#define RK_INLINE static inline __attribute__((always_inline))
+
+/* append character c to the RK hash h of family fam */
+RK_INLINE long long
+rk_append_fam(long long h, unsigned char c, int fam)
+{
+	switch (fam) {
+		case HASH_M61:
+			return (long long)m61_reduce(m61_shl8((unsigned long long)h) + c);
+		case HASH_W64:
+			return (long long)((unsigned long long)h * W64_BASE + c);
+		default:
+			return madd(mmul(256, h), c);
+	}
+}
+
+/* rk_append_fam for the hash family selected with -f */
+static inline long long
+rk_append(long long h, unsigned char c)
+{
+	return rk_append_fam(h, c, which_hash);
+}
+
+/* Slide the window of RK hash h of family fam by one character: remove its
+   leading character c_out (whose weight is base_exp) and append c_in */
+RK_INLINE long long
+rk_roll_fam(long long h, unsigned char c_out, unsigned char c_in, long long base_exp, int fam)
+{
+	unsigned long long u;
+
+	switch (fam) {
+		case HASH_M61:
+			u = (unsigned long long)h + M61 - m61_mul(c_out, (unsigned long long)base_exp);
+			return (long long)m61_reduce(m61_shl8(m61_reduce(u)) + c_in);
+		case HASH_W64:
+			u = (unsigned long long)h - c_out * (unsigned long long)base_exp;
+			return (long long)(u * W64_BASE + c_in);
+		default:
+			return madd(mmul(256, mdel(h, mmul(c_out, base_exp))), c_in);
+	}
+}
+
+/* Return the RK hash of family fam of the window s[a..b), from the hashes 
+   p_b of s[0..b) and p_a of s[0..a): p_b less p_a shifted past the window,
+   where bk is the base to the power b-a. Under HASH_MOD, whose madd and 
+   mdel may give the prime itself for 0, this differs from the rolled hash 
+   only in such a representation of 0. */
+RK_INLINE long long
+rk_window_fam(long long p_b, long long p_a, long long bk, int fam)
+{
+	switch (fam) {
+		case HASH_M61:
+			return (long long)m61_reduce((unsigned long long)p_b + M61 - 
+			    m61_mul((unsigned long long)p_a, (unsigned long long)bk));
+		case HASH_W64:
+			return (long long)((unsigned long long)p_b - (unsigned long long)p_a * (unsigned long long)bk);
+		default:
+			return mdel(p_b, mmul(p_a, bk));
+	}
+}
+
+/* rk_roll_fam for the hash family selected with -f */
+static inline long long
+rk_roll(long long h, unsigned char c_out, unsigned char c_in, long long base_exp)
+{
+	return rk_roll_fam(h, c_out, c_in, base_exp, which_hash);
+}
+
+/* compute the RK hash of the k characters starting at s */
+long long
+rk_hash(const unsigned char *s, int k)
+{
+	int i;
+	long long h = 0;
+
+	for (i = 0; i < k; i++) {
+		h = rk_append(h, s[i]);
+	}
+	return h;
+}
+
+/* compute base^(k-1), the weight of the leading character of a k-character 
+   window, for hash family fam; for a constant k and fam other than HASH_MOD
+   (whose modulus is set with -q) this is a compile-time constant */
+RK_INLINE long long
+rk_base_exp_fam(int k, int fam)
+{
+	int i;
+	long long base_exp = 1;
+
+	for (i = 0; i < k - 1; i++) {
+		switch (fam) {
+			case HASH_M61:
+				base_exp = (long long)m61_shl8((unsigned long long)base_exp);
+				break;
+			case HASH_W64:
+				base_exp = (long long)((unsigned long long)base_exp * W64_BASE);
+				break;
+			default:
+				base_exp = mmul(256, base_exp);
+		}
+	}
+	return base_exp;
+}
+
+/* rk_base_exp_fam for the hash family selected with -f */
+long long
+rk_base_exp(int k)
+{
+	return rk_base_exp_fam(k, which_hash);
+}
+
+/* Instantiate a function fn##_k##K for every window length K the hot loops
+   are specialized for, and a dispatcher fn##_dispatch that picks one by k
+   and which_hash, falling back to fn##_generic. GEN(K, FAM) must expand to 
+   the call of the always-inlined loop for window length K and family FAM. */
+#define RK_SPECIALIZE_K(fn, ret, params, GEN, K) \
+	static ret fn##_k##K params \
+	{ \
+		switch (which_hash) { \
+			case HASH_M61: return GEN(K, HASH_M61); \
+			case HASH_W64: return GEN(K, HASH_W64); \
+			default: return GEN(K, HASH_MOD); \
+		} \
+	}
+#define RK_SPECIALIZE(fn, ret, params, GEN) \
+	RK_SPECIALIZE_K(fn, ret, params, GEN, 8) \
+	RK_SPECIALIZE_K(fn, ret, params, GEN, 16) \
+	RK_SPECIALIZE_K(fn, ret, params, GEN, 20) \
+	RK_SPECIALIZE_K(fn, ret, params, GEN, 32)
+
+/* the weight of a window's leading character: a constant unless fam is HASH_MOD */
+#define RK_BASE_EXP(K, FAM, runtime) (((FAM) == HASH_MOD) ? (runtime) : rk_base_exp_fam((K), (FAM)))
+
+/* open the document 'fname' for reading; "-" is the standard input */
+int
+open_doc(const char *fname)
+{
+	if (strcmp(fname, "-") == 0) {
+		return dup(STDIN_FILENO);
+	}
+	return open(fname, O_RDONLY);
 }
 
 /* read the entire content of the file 'fname' into a 
 	 character array allocated by this procedure.
 	 Upon return, *doc contains the address of the character array
 	 *doc_len contains the length of the array
+	 The array has one spare byte past the end for a terminating 0.
+	 Files whose size fstat can not tell (e.g. pipes) are read until EOF.
 	 */
 void
-read_file(const char *fname, unsigned char **doc, int *doc_len) 
+read_file(const char *fname, unsigned char **doc, long long *doc_len) 
 {
 	struct stat st;
 	int fd;
-	int n = 0;
+	long long cap, n = 0;
+	ssize_t r;
 
-	fd = open(fname, O_RDONLY);
+	fd = open_doc(fname);
 	if (fd < 0) {
 		perror("read_file: open ");
 		exit(1);
@@ -77,189 +718,3482 @@ read_file(const char *fname, unsigned char **doc, int *doc_len)
 		exit(1);
 	}
 
-	*doc = (unsigned char *)malloc(st.st_size);
+	cap = (S_ISREG(st.st_mode) && st.st_size > 0) ? (long long)st.st_size : 65536;
+	*doc = (unsigned char *)malloc(cap + 1);
 	if (!(*doc)) {
-		fprintf(stderr, " failed to allocate %d bytes. No memory\n", (int)st.st_size);
+		fprintf(stderr, " failed to allocate %lld bytes. No memory\n", cap + 1);
 		exit(1);
 	}
 
-	n = read(fd, *doc, st.st_size);
-	if (n < 0) {
-		perror("read_file: read ");
-		exit(1);
-	}else if (n != st.st_size) {
-		fprintf(stderr,"read_file: short read!\n");
-		exit(1);
+	while ((r = read(fd, *doc + n, cap - n)) != 0) {
+		if (r < 0) {
+			perror("read_file: read ");
+			exit(1);
+		}
+		n += r;
+		if (n == cap) {
+			cap *= 2;
+			*doc = (unsigned char *)realloc(*doc, cap + 1);
+			if (!(*doc)) {
+				fprintf(stderr, " failed to allocate %lld bytes. No memory\n", cap + 1);
+				exit(1);
+			}
+		}
 	}
 	
 	close(fd);
 	*doc_len = n;
 }
 
-/* The normalize procedure normalizes a character array of size len 
-   according to the following rules:
-	 1) turn all upper case letters into lower case ones
-	 2) turn any white-space character into a space character and, 
-	    shrink any n>1 consecutive whitespace characters to exactly 1 whitespace
-	 3) remove all spaces at the beginning and end
+/* Map the file 'fname' read-only into memory instead of copying it.
+   Upon return, fm->buf points to the content and fm->len is its length.
+   Files that can not be mapped (pipes, empty files) are read with read_file. */
+void
+map_file(const char *fname, file_map *fm)
+{
+	struct stat st;
+	int fd;
+	void *p;
 
-	 When the procedure returns, the character array buf contains the newly 
-     normalized string and the return value is the new length of the normalized string.
+	fd = open_doc(fname);
+	if (fd < 0) {
+		perror("map_file: open ");
+		exit(1);
+	}
 
-     hint: you may want to use C library function isupper, isspace, tolower
-     do "man isupper"
-*/
-int
-normalize(unsigned char *buf,	/* The character array contains the string to be normalized*/
-					int len	    /* the size of the original character array */)
-{
-    int i;
-    int j;
+	if (fstat(fd, &st) != 0) {
+		perror("map_file: fstat ");
+		exit(1);
+	}
 
-    for (i=j=0; i < len; i++) {
-    	if (isupper(buf[i])) {
-    		buf[j++] = tolower(buf[i]);
-    	} else if(isspace(buf[i])) {
-    		// only insert if not at beginning or end; and not consecutive
-    		if ((i > 0) && (i < (len-1)) && !isspace(buf[i-1])) {
-    			buf[j++] = ' ';
-    		}
-    	} else {
-    		buf[j++] = buf[i];
-    	}
-    }
-    buf[j] = 0; // finished
+	if (S_ISREG(st.st_mode) && st.st_size > 0) {
+		p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (p != MAP_FAILED) {
+			/* every pass over a document is a front-to-back scan */
+			madvise(p, st.st_size, MADV_SEQUENTIAL);
+			close(fd);
+			fm->buf = (unsigned char *)p;
+			fm->len = st.st_size;
+			fm->mapped = 1;
+			return;
+		}
+	}
+	close(fd);
 
-    return j;
+	read_file(fname, &fm->buf, &fm->len);
+	fm->mapped = 0;
 }
 
-int
-exact_match(const unsigned char *qs, int m, 
-        const unsigned char *ts, int n)
+void
+unmap_file(file_map *fm)
 {
-	// first make sure they are the same length
-	if (m != n) {
-		return 0;
+	if (fm->mapped) {
+		munmap(fm->buf, fm->len);
+	} else {
+		free(fm->buf);
 	}
+	fm->buf = NULL;
+	fm->len = 0;
+}
 
-	int i;
-	for (i=0; qs[i]; i++) {
-		if (qs[i] != ts[i]) {
-			return 0;
+void
+norm_state_init(norm_state *ns)
+{
+	ns->prev_space = 1;
+	ns->pending = 0;
+}
+
+/* Normalize the next len characters src of a string that is fed in blocks,
+   writing to dst, which must have room for len+1 characters. dst may be src.
+   A whitespace run becomes one space only once a character follows the run
+   start, so normalizing the blocks one after another gives the same string
+   as normalizing all of them at once. Return the number of characters written.
+   This is the reference version; the vector kernels below must agree with it. */
+long long
+normalize_stream_scalar(norm_state *ns,           /* state carried from the previous block */
+                        unsigned char *dst,       /* where the normalized characters go */
+                        const unsigned char *src, /* the next characters to be normalized */
+                        long long len             /* the number of characters in src */)
+{
+	long long i;
+	long long j;
+	int prev_space = ns->prev_space;
+	int pending = ns->pending;
+
+	for (i=j=0; i < len; i++) {
+		if (pending) {
+			dst[j++] = ' ';
+			pending = 0;
+		}
+		if (isspace(src[i])) {
+			// only the first whitespace of a run, and not at the beginning
+			pending = !prev_space;
+			prev_space = 1;
+		} else {
+			dst[j++] = isupper(src[i]) ? tolower(src[i]) : src[i];
+			prev_space = 0;
 		}
-    }
+	}
 
-    // we've passed all check thus far, so it must be okay
-    return 1;
+	ns->prev_space = prev_space;
+	ns->pending = pending;
+	return j;
 }
 
-/* check if a query string ps (of length k) appears 
-	 in ts (of length n) as a substring 
-	 If so, return 1. Else return 0
-	 You may want to use the library function strncmp
-	 */
-int
-simple_substr_match(const unsigned char *ps,	/* the query string */
-						 int k, 					/* the length of the query string */
-						 const unsigned char *ts,	/* the document string (Y) */ 
-						 int n						/* the length of the document Y */)
+typedef long long (*normalize_fn)(norm_state *, unsigned char *, const unsigned char *, long long);
+
+/* The vector kernels lowercase A-Z, turn the whitespace characters ' ', \t, \n, 
+   \v, \f, \r into spaces and compute a bit mask of the characters to keep 
+   (all but the whitespace that is not the first of its run) for 16 or 32 
+   characters at a time; this is what isupper, tolower and isspace do in the 
+   C locale rkmatch runs in. The kept characters are then packed 8 at a time 
+   with a byte shuffle whose indices are looked up in norm_pack[keep mask].
+   A kernel stops while at least one character is left, so a first whitespace 
+   it keeps is always followed by another character, and hands the rest to 
+   normalize_stream_scalar, which settles what is pending at the end. 
+   All of a vector is loaded before any of it is written, and with nothing
+   pending the output never gets ahead of the input, so dst may still be src. */
+unsigned char norm_pack[256][8];
+
+static void
+norm_pack_init(void)
 {
-	// iterate through all substrings of ts
-	int i;
-	int j;
-	for (i=0; i < n; i++) {
-		for (j=0; j < k; j++) {
-			if(ts[i+j] == ps[j]) {
-				if((j+1) == k) {
-					return 1;
-				}
-			} else {
-				break;
+	int m, b, n;
+
+	for (m = 0; m < 256; m++) {
+		n = 0;
+		for (b = 0; b < 8; b++) {
+			if (m & (1 << b)) {
+				norm_pack[m][n++] = b;
 			}
 		}
-   	}
-	return 0;
+		for (; n < 8; n++) {
+			norm_pack[m][n] = 0x80; /* selects a zero byte */
+		}
+	}
 }
 
-/* Check if a query string ps (of length k) appears 
-	 in ts (of length n) as a substring using the rabin-karp algorithm
-	 If so, return 1. Else return 0
+/* the keep mask of w characters whose whitespace mask is ws, given whether 
+   the character before them was whitespace */
+static inline unsigned int
+norm_keep(unsigned int ws, int prev_space, int w)
+{
+	unsigned int all = (w == 32) ? 0xffffffffU : ((1U << w) - 1);
 
+	return ~(ws & ((ws << 1) | (unsigned int)prev_space)) & all;
+}
 
-	 In addition, print the hash value of ps (on one line)
-	 as well as the first 'PRINT_RK_HASH' hash values of ts (on another line)
-	 Example:
-	 $ ./rkmatch -t 1 -k 20 X Y
-	 4537305142160169
-	 1137948454218999 2816897116259975 4720517820514748 4092864945588237 3539905993503426 
-	 2021356707496909
-	 1137948454218999 2816897116259975 4720517820514748 4092864945588237 3539905993503426 
-	 0 chunks matched (out of 2), percentage: 0.00
+#if defined(__i386__) || defined(__x86_64__)
 
-	Hint: Use "long long" type for the RK hash value.  Use printf("%lld", x) to print 
-	out x of long long type.
-	 */
-int
-rabin_karp_match(const unsigned char *ps,	/* the query string */
-								 int k, 					/* the length of the query string */
-								 const unsigned char *ts,	/* the document string (Y) */ 
-								 int n						/* the length of the document Y */ )
+/* write the characters of v selected by the 16-bit mask keep to dst */
+__attribute__((target("ssse3")))
+static inline long long
+norm_pack16_ssse3(unsigned char *dst, __m128i v, unsigned int keep)
 {
-	int i, j, printed;
-	int response = 0;
-	long long base = 256;
-	long long base_exp = 1;
-	long long ps_hash = 0;
-	long long ts_hash = 0;
+	unsigned int lo = keep & 0xff;
+	unsigned int hi = (keep >> 8) & 0xff;
+	long long j;
 
-	// get base^(k-1)
-	for (i = 0; i < k - 1; i++) {
-		base_exp = mmul(base, base_exp);
-	}
+	_mm_storel_epi64((__m128i *)dst, 
+	    _mm_shuffle_epi8(v, _mm_loadl_epi64((const __m128i *)norm_pack[lo])));
+	j = __builtin_popcount(lo);
+	_mm_storel_epi64((__m128i *)(dst + j), 
+	    _mm_shuffle_epi8(_mm_srli_si128(v, 8), _mm_loadl_epi64((const __m128i *)norm_pack[hi])));
+	return j + __builtin_popcount(hi);
+}
 
-	// create initial hashes
+__attribute__((target("ssse3")))
+long long
+normalize_stream_ssse3(norm_state *ns, unsigned char *dst, const unsigned char *src, long long len)
+{
+	const __m128i upper_off = _mm_set1_epi8((char)(0x80 - 'A'));
+	const __m128i upper_lim = _mm_set1_epi8((char)(0x80 + 26));
+	const __m128i ctrl_off = _mm_set1_epi8((char)(0x80 - '\t'));
+	const __m128i ctrl_lim = _mm_set1_epi8((char)(0x80 + 5));
+	const __m128i space = _mm_set1_epi8(' ');
+	const __m128i case_bit = _mm_set1_epi8(0x20);
+	__m128i v, up, ws;
+	unsigned int mask;
+	long long i = 0, j = 0;
+
+	if (ns->pending && len > 16) {
+		dst[j++] = ' ';
+		ns->pending = 0;
+	}
+	for (; i + 16 < len; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)(src + i));
+		up = _mm_cmplt_epi8(_mm_add_epi8(v, upper_off), upper_lim);
+		v = _mm_add_epi8(v, _mm_and_si128(up, case_bit));
+		ws = _mm_or_si128(_mm_cmpeq_epi8(v, space), 
+		    _mm_cmplt_epi8(_mm_add_epi8(v, ctrl_off), ctrl_lim));
+		v = _mm_or_si128(_mm_andnot_si128(ws, v), _mm_and_si128(ws, space));
+		mask = (unsigned int)_mm_movemask_epi8(ws);
+
+		j += norm_pack16_ssse3(dst + j, v, norm_keep(mask, ns->prev_space, 16));
+		ns->prev_space = (mask >> 15) & 1;
+	}
+	return j + normalize_stream_scalar(ns, dst + j, src + i, len - i);
+}
+
+__attribute__((target("avx2")))
+long long
+normalize_stream_avx2(norm_state *ns, unsigned char *dst, const unsigned char *src, long long len)
+{
+	const __m256i upper_off = _mm256_set1_epi8((char)(0x80 - 'A'));
+	const __m256i upper_lim = _mm256_set1_epi8((char)(0x80 + 26));
+	const __m256i ctrl_off = _mm256_set1_epi8((char)(0x80 - '\t'));
+	const __m256i ctrl_lim = _mm256_set1_epi8((char)(0x80 + 5));
+	const __m256i space = _mm256_set1_epi8(' ');
+	const __m256i case_bit = _mm256_set1_epi8(0x20);
+	__m256i v, up, ws;
+	unsigned int mask, keep;
+	long long i = 0, j = 0;
+
+	if (ns->pending && len > 32) {
+		dst[j++] = ' ';
+		ns->pending = 0;
+	}
+	for (; i + 32 < len; i += 32) {
+		v = _mm256_loadu_si256((const __m256i *)(src + i));
+		/* signed compares: x < lim is lim > x */
+		up = _mm256_cmpgt_epi8(upper_lim, _mm256_add_epi8(v, upper_off));
+		v = _mm256_add_epi8(v, _mm256_and_si256(up, case_bit));
+		ws = _mm256_or_si256(_mm256_cmpeq_epi8(v, space), 
+		    _mm256_cmpgt_epi8(ctrl_lim, _mm256_add_epi8(v, ctrl_off)));
+		v = _mm256_blendv_epi8(v, space, ws);
+		mask = (unsigned int)_mm256_movemask_epi8(ws);
+
+		keep = norm_keep(mask, ns->prev_space, 32);
+		j += norm_pack16_ssse3(dst + j, _mm256_castsi256_si128(v), keep & 0xffff);
+		j += norm_pack16_ssse3(dst + j, _mm256_extracti128_si256(v, 1), keep >> 16);
+		ns->prev_space = (mask >> 31) & 1;
+	}
+	return j + normalize_stream_scalar(ns, dst + j, src + i, len - i);
+}
+
+#elif defined(__ARM_NEON)
+
+long long
+normalize_stream_neon(norm_state *ns, unsigned char *dst, const unsigned char *src, long long len)
+{
+	static const uint8_t bit_weights[16] = {1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+	const uint8x16_t weights = vld1q_u8(bit_weights);
+	const uint8x16_t space = vdupq_n_u8(' ');
+	uint8x16_t v, up, ws;
+	uint8x8_t p;
+	unsigned int mask, keep, lo, hi;
+	long long i = 0, j = 0;
+
+	if (ns->pending && len > 16) {
+		dst[j++] = ' ';
+		ns->pending = 0;
+	}
+	for (; i + 16 < len; i += 16) {
+		v = vld1q_u8(src + i);
+		up = vcltq_u8(vsubq_u8(v, vdupq_n_u8('A')), vdupq_n_u8(26));
+		v = vaddq_u8(v, vandq_u8(up, vdupq_n_u8(0x20)));
+		ws = vorrq_u8(vceqq_u8(v, space), 
+		    vcltq_u8(vsubq_u8(v, vdupq_n_u8('\t')), vdupq_n_u8(5)));
+		v = vbslq_u8(ws, space, v);
+
+		/* movemask: add up the bit weights of each half */
+		p = vpadd_u8(vget_low_u8(vandq_u8(ws, weights)), vget_high_u8(vandq_u8(ws, weights)));
+		p = vpadd_u8(p, p);
+		p = vpadd_u8(p, p);
+		mask = vget_lane_u8(p, 0) | ((unsigned int)vget_lane_u8(p, 1) << 8);
+
+		keep = norm_keep(mask, ns->prev_space, 16);
+		lo = keep & 0xff;
+		hi = keep >> 8;
+		vst1_u8(dst + j, vtbl1_u8(vget_low_u8(v), vld1_u8(norm_pack[lo])));
+		j += __builtin_popcount(lo);
+		vst1_u8(dst + j, vtbl1_u8(vget_high_u8(v), vld1_u8(norm_pack[hi])));
+		j += __builtin_popcount(hi);
+		ns->prev_space = (mask >> 15) & 1;
+	}
+	return j + normalize_stream_scalar(ns, dst + j, src + i, len - i);
+}
+
+#endif
+
+/* the kernel normalize_stream runs, picked once for the CPU we run on */
+normalize_fn normalize_kernel = NULL;
+pthread_once_t normalize_once = PTHREAD_ONCE_INIT;
+
+static void
+normalize_pick(void)
+{
+	norm_pack_init();
+	normalize_kernel = normalize_stream_scalar;
+#if defined(__i386__) || defined(__x86_64__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		normalize_kernel = normalize_stream_avx2;
+	} else if (__builtin_cpu_supports("ssse3")) {
+		normalize_kernel = normalize_stream_ssse3;
+	}
+#elif defined(__ARM_NEON)
+	normalize_kernel = normalize_stream_neon;
+#endif
+}
+
+/* Same as normalize_stream_scalar, but with the fastest kernel this CPU has. */
+long long
+normalize_stream(norm_state *ns,           /* state carried from the previous block */
+                 unsigned char *dst,       /* where the normalized characters go */
+                 const unsigned char *src, /* the next characters to be normalized */
+                 long long len             /* the number of characters in src */)
+{
+	pthread_once(&normalize_once, normalize_pick);
+	return normalize_kernel(ns, dst, src, len);
+}
+
+/* the normalize_parallel work that work_pool shares: src is cut into 
+   nblocks blocks, and each is normalized as if it started the string */
+typedef struct {
+	const unsigned char *src;
+	long long len;
+	long long nblocks;
+	unsigned char *tmp;    /* each block's output, at the block's offset */
+	long long *out_len;    /* the length of each block's output */
+	norm_state *out_state; /* the state each block leaves */
+	long long *dst_off;    /* where each block's output goes in dst */
+	int *lead;             /* 1 if the block's output in dst starts with a space */
+	unsigned char *dst;
+} norm_job;
+
+/* task: normalize block number 'task' from the initial state into tmp */
+static void
+norm_block_task(void *ctx, long long task, int worker)
+{
+	norm_job *job = (norm_job *)ctx;
+	long long a = job->len * task / job->nblocks;
+	long long b = job->len * (task + 1) / job->nblocks;
+	norm_state ns;
+
+	(void)worker;
+	norm_state_init(&ns);
+	job->out_len[task] = normalize_stream(&ns, job->tmp + a, job->src + a, b - a);
+	job->out_state[task] = ns;
+}
+
+/* task: copy the output of block number 'task' to its place in dst */
+static void
+norm_copy_task(void *ctx, long long task, int worker)
+{
+	norm_job *job = (norm_job *)ctx;
+	long long a = job->len * task / job->nblocks;
+	unsigned char *d = job->dst + job->dst_off[task];
+
+	(void)worker;
+	if (job->lead[task]) {
+		*d++ = ' ';
+	}
+	memcpy(d, job->tmp + a, job->out_len[task]);
+}
+
+/* Normalize the len characters src into dst (which must not be src) on the
+   threads of work_pool, and return the length of the result, which is the
+   same as normalize_stream from the initial state gives.
+   Each block is normalized by itself from the initial state, as if it 
+   started the string. What the blocks before it leave pending can only 
+   change that by a space in front, and only through the block's first two
+   characters: past them, the state is the same whatever it was coming in.
+   So a scan over the blocks in order, normalizing just those two characters
+   from the state the previous block left and from the initial state, finds
+   each block's leading space, the state it leaves and, summing the lengths,
+   where its output goes; then the outputs are copied into place. */
+static long long
+normalize_parallel(unsigned char *dst, const unsigned char *src, long long len)
+{
+	norm_job job;
+	norm_state ns, head_ns, init_ns;
+	unsigned char head[4];
+	long long t, a, b, h, off = 0, with_state, from_init;
+
+	job.src = src;
+	job.len = len;
+	job.dst = dst;
+	job.nblocks = 4 * work_pool->nthreads;
+	job.tmp = (unsigned char *)huge_alloc(len);
+	job.out_len = (long long *)malloc(sizeof(long long) * job.nblocks);
+	job.out_state = (norm_state *)malloc(sizeof(norm_state) * job.nblocks);
+	job.dst_off = (long long *)malloc(sizeof(long long) * job.nblocks);
+	job.lead = (int *)malloc(sizeof(int) * job.nblocks);
+	if (!job.out_len || !job.out_state || !job.dst_off || !job.lead) {
+		fprintf(stderr, " failed to allocate %lld blocks. No memory\n", job.nblocks);
+		exit(1);
+	}
+
+	pool_run(work_pool, norm_block_task, &job, job.nblocks);
+
+	/* the exclusive prefix scan of the block outputs, and the state between blocks */
+	norm_state_init(&ns);
+	for (t = 0; t < job.nblocks; t++) {
+		a = len * t / job.nblocks;
+		b = len * (t + 1) / job.nblocks;
+		h = (b - a < 2) ? b - a : 2;
+		head_ns = ns;
+		norm_state_init(&init_ns);
+		with_state = normalize_stream_scalar(&head_ns, head, src + a, h);
+		from_init = normalize_stream_scalar(&init_ns, head, src + a, h);
+		job.lead[t] = (int)(with_state - from_init);
+		job.dst_off[t] = off;
+		off += job.lead[t] + job.out_len[t];
+		ns = (b - a > 2) ? job.out_state[t] : head_ns;
+	}
+
+	pool_run(work_pool, norm_copy_task, &job, job.nblocks);
+
+	huge_free(job.tmp, len);
+	free(job.out_len);
+	free(job.out_state);
+	free(job.dst_off);
+	free(job.lead);
+	return off;
+}
+
+/* Same as normalize, but read the string from src and write the normalized 
+   string to dst, which must have room for len+1 characters. dst may be src.
+   With work_pool, a long string normalized into another buffer is shared 
+   with its threads (see normalize_parallel). */
+long long
+normalize_into(unsigned char *dst,       /* where the normalized string goes */
+               const unsigned char *src, /* the string to be normalized */
+               long long len             /* the size of src */)
+{
+	norm_state ns;
+	long long j;
+
+	if (work_pool && dst != src && len >= NORMALIZE_PARALLEL_MIN) {
+		j = normalize_parallel(dst, src, len);
+		dst[j] = 0;
+		return j;
+	}
+	norm_state_init(&ns);
+	j = normalize_stream(&ns, dst, src, len);
+	dst[j] = 0; // finished; a space still pending would have been trailing
+
+	return j;
+}
+
+/* The normalize procedure normalizes a character array of size len 
+   according to the following rules:
+	 1) turn all upper case letters into lower case ones
+	 2) turn any white-space character into a space character and, 
+	    shrink any n>1 consecutive whitespace characters to exactly 1 whitespace
+	 3) remove all spaces at the beginning and end
+
+	 When the procedure returns, the character array buf contains the newly 
+     normalized string and the return value is the new length of the normalized string.
+     buf must have room for len+1 characters.
+
+     hint: you may want to use C library function isupper, isspace, tolower
+     do "man isupper"
+*/
+long long
+normalize(unsigned char *buf,	/* The character array contains the string to be normalized*/
+					long long len	    /* the size of the original character array */)
+{
+	return normalize_into(buf, buf, len);
+}
+
+/* Load the file 'fname' and normalize it into an array allocated from a.
+   The file itself is only mapped, so the normalized copy is the only 
+   private memory the document costs. If orig is not NULL, the original
+   is kept in it (see offset_map) instead of being unmapped. */
+void
+load_doc_keep(arena *a, const char *fname, unsigned char **doc, long long *doc_len, file_map *orig)
+{
+	file_map fm;
+	struct timespec ts0;
+
+	ts0 = phase_start();
+	map_file(fname, &fm);
+	phase_end(PH_READ, ts0, fm.len);
+	*doc = (unsigned char *)arena_alloc(a, fm.len + 1);
+	/* a mapped file is only read as normalize touches its pages */
+	ts0 = phase_start();
+	*doc_len = normalize_into(*doc, fm.buf, fm.len);
+	phase_end(PH_NORMALIZE, ts0, fm.len);
+	if (orig) {
+		*orig = fm;
+	} else {
+		unmap_file(&fm);
+	}
+}
+
+void
+load_doc(arena *a, const char *fname, unsigned char **doc, long long *doc_len)
+{
+	load_doc_keep(a, fname, doc, doc_len, NULL);
+}
+
+/* A doc prefetcher is a thread that has the kernel read the docs of a run
+   into the page cache while the matcher works on earlier ones: once doc d
+   is asked for (prefetch_advance), the docs up to d+PREFETCH_DOCS are read
+   ahead, so a bounded number of docs is in flight ahead of the matcher 
+   threads. It only opens each doc and hints the kernel (POSIX_FADV_WILLNEED),
+   which starts the reads and returns, so the opens and fstats that can stall
+   on a network filesystem are waited for on this thread; the docs are then
+   loaded as before, without waiting for the disk. */
+#define PREFETCH_DOCS 8
+
+typedef struct {
+	char **names;        /* the docs of the run, in the order they are matched */
+	int ndocs;
+	int next;            /* the next doc to read ahead */
+	int limit;           /* read ahead the docs before this one */
+	int quit;            /* set by prefetcher_stop */
+	pthread_mutex_t lock;
+	pthread_cond_t more; /* signalled when limit grows or the prefetcher stops */
+	pthread_t thread;
+} doc_prefetcher;
+
+/* the prefetcher of the docs of the run, or NULL */
+doc_prefetcher *prefetcher = NULL;
+
+/* have the kernel start reading the doc fname; stdin and what is not a 
+   regular file are left alone, and errors are left to the load to report */
+static void
+prefetch_doc(const char *fname)
+{
+	struct stat st;
+	int fd;
+
+	if (strcmp(fname, "-") == 0) {
+		return;
+	}
+	fd = open(fname, O_RDONLY);
+	if (fd < 0) {
+		return;
+	}
+#ifdef POSIX_FADV_WILLNEED
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+		posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+	}
+#endif
+	close(fd);
+}
+
+static void *
+prefetcher_thread(void *arg)
+{
+	doc_prefetcher *pf = (doc_prefetcher *)arg;
+	int d;
+
+	pthread_mutex_lock(&pf->lock);
+	while (!pf->quit) {
+		if (pf->next >= pf->limit || pf->next >= pf->ndocs) {
+			pthread_cond_wait(&pf->more, &pf->lock);
+			continue;
+		}
+		d = pf->next++;
+		pthread_mutex_unlock(&pf->lock);
+		prefetch_doc(pf->names[d]);
+		pthread_mutex_lock(&pf->lock);
+	}
+	pthread_mutex_unlock(&pf->lock);
+	return NULL;
+}
+
+/* start reading ahead the ndocs docs names[], beginning with the first PREFETCH_DOCS */
+void
+prefetcher_start(doc_prefetcher *pf, char **names, int ndocs)
+{
+	pf->names = names;
+	pf->ndocs = ndocs;
+	pf->next = 0;
+	pf->limit = PREFETCH_DOCS;
+	pf->quit = 0;
+	pthread_mutex_init(&pf->lock, NULL);
+	pthread_cond_init(&pf->more, NULL);
+	if (pthread_create(&pf->thread, NULL, prefetcher_thread, pf) != 0) {
+		perror("prefetcher_start: pthread_create ");
+		exit(1);
+	}
+}
+
+/* doc d is being loaded: read ahead up to PREFETCH_DOCS docs past it (pf may be NULL) */
+void
+prefetch_advance(doc_prefetcher *pf, int d)
+{
+	if (!pf) {
+		return;
+	}
+	pthread_mutex_lock(&pf->lock);
+	if (d + 1 + PREFETCH_DOCS > pf->limit) {
+		pf->limit = d + 1 + PREFETCH_DOCS;
+		pthread_cond_signal(&pf->more);
+	}
+	pthread_mutex_unlock(&pf->lock);
+}
+
+void
+prefetcher_stop(doc_prefetcher *pf)
+{
+	pthread_mutex_lock(&pf->lock);
+	pf->quit = 1;
+	pthread_cond_signal(&pf->more);
+	pthread_mutex_unlock(&pf->lock);
+	pthread_join(pf->thread, NULL);
+	pthread_mutex_destroy(&pf->lock);
+	pthread_cond_destroy(&pf->more);
+}
+
+/* An offset map takes the offsets of a normalized document back to the
+   original. Normalizing drops all but the first character of a whitespace
+   run (and the whole of a leading or trailing run), so a normalized 
+   character lies a fixed distance behind its original between two such
+   collapse points; the map is a sorted table of the normalized offsets 
+   where that distance changes, with the original offset of each.
+   It is built from the original only the first time it is looked up, 
+   and then the original is let go of. */
+typedef struct {
+	long long *norm; /* normalized offsets where a run of fixed distance starts */
+	long long *orig; /* original offset of each of them */
+	long long n;     /* number of runs after the first (which has distance 0) */
+	file_map src;    /* the original document until the map is built */
+	int built;
+} offset_map;
+
+void
+offset_map_init(offset_map *om, file_map *src)
+{
+	om->norm = om->orig = NULL;
+	om->n = 0;
+	om->src = *src;
+	om->built = 0;
+}
+
+static void
+offset_map_add(offset_map *om, long long *cap, long long j, long long i)
+{
+	if (om->n == *cap) {
+		*cap = *cap ? 2 * *cap : 64;
+		om->norm = (long long *)realloc(om->norm, sizeof(long long) * *cap);
+		om->orig = (long long *)realloc(om->orig, sizeof(long long) * *cap);
+		if (!om->norm || !om->orig) {
+			fprintf(stderr, " failed to allocate %lld offsets. No memory\n", *cap);
+			exit(1);
+		}
+	}
+	om->norm[om->n] = j;
+	om->orig[om->n] = i;
+	om->n++;
+}
+
+/* Walk the original the way normalize_stream_scalar does, noting every 
+   normalized character whose distance from its original differs from the 
+   one before it. A space stands for the first whitespace of its run. */
+static void
+offset_map_build(offset_map *om)
+{
+	const unsigned char *src = om->src.buf;
+	long long i, j, cap = 0, dist = 0, run = 0;
+	int prev_space = 1, pending = 0;
+
+	for (i = j = 0; i < om->src.len; i++) {
+		if (pending) {
+			if (run - j != dist) {
+				dist = run - j;
+				offset_map_add(om, &cap, j, run);
+			}
+			j++;
+			pending = 0;
+		}
+		if (isspace(src[i])) {
+			if (!prev_space) {
+				pending = 1;
+				run = i;
+			}
+			prev_space = 1;
+		} else {
+			if (i - j != dist) {
+				dist = i - j;
+				offset_map_add(om, &cap, j, i);
+			}
+			j++;
+			prev_space = 0;
+		}
+	}
+	unmap_file(&om->src);
+	om->built = 1;
+}
+
+/* the original offset of the character at normalized offset p */
+long long
+offset_map_lookup(offset_map *om, long long p)
+{
+	long long lo = 0, hi, mid;
+
+	if (!om->built) {
+		offset_map_build(om);
+	}
+	/* find the last run that starts at or before p */
+	for (hi = om->n; lo < hi; ) {
+		mid = lo + (hi - lo) / 2;
+		if (om->norm[mid] <= p) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return (lo == 0) ? p : om->orig[lo - 1] + (p - om->norm[lo - 1]);
+}
+
+void
+offset_map_free(offset_map *om)
+{
+	if (!om->built) {
+		unmap_file(&om->src);
+	}
+	free(om->norm);
+	free(om->orig);
+}
+
+int
+exact_match(const unsigned char *qs, long long m, 
+        const unsigned char *ts, long long n)
+{
+	// first make sure they are the same length
+	if (m != n) {
+		return 0;
+	}
+
+	// then compare every byte
+	return memcmp(qs, ts, m) == 0;
+}
+
+/* Same as simple_substr_match, without vector instructions: memchr finds 
+   the candidates (the positions of ps's first byte), and only those whose
+   last byte also matches are compared in full. This is the reference the
+   vector kernels below must agree with. */
+int
+simple_substr_scalar(const unsigned char *ps, int k, const unsigned char *ts, long long n)
+{
+	const unsigned char *p, *end;
+
+	if (k <= 0 || n < k) {
+		return k <= 0;
+	}
+	p = ts;
+	end = ts + (n - k + 1); /* one past the last position a match can start at */
+	while (p < end && (p = (const unsigned char *)memchr(p, ps[0], end - p)) != NULL) {
+		if (p[k-1] == ps[k-1] && memcmp(p, ps, k) == 0) {
+			return 1;
+		}
+		p++;
+	}
+	return 0;
+}
+
+typedef int (*substr_fn)(const unsigned char *, int, const unsigned char *, long long);
+
+/* The vector kernels compare the first byte of ps against 16 or 32 
+   consecutive positions of ts, and the last byte of ps against the k-1 
+   positions further on, at once. Only the positions where both agree are
+   compared in full. The positions left over at the end go to 
+   simple_substr_scalar. */
+#if defined(__i386__) || defined(__x86_64__)
+
+__attribute__((target("sse2")))
+int
+simple_substr_sse2(const unsigned char *ps, int k, const unsigned char *ts, long long n)
+{
+	const __m128i first = _mm_set1_epi8((char)ps[0]);
+	const __m128i last = _mm_set1_epi8((char)ps[k-1]);
+	unsigned int mask;
+	long long i;
+
+	for (i = 0; i + k - 1 + 16 <= n; i += 16) {
+		mask = (unsigned int)_mm_movemask_epi8(_mm_and_si128(
+		    _mm_cmpeq_epi8(first, _mm_loadu_si128((const __m128i *)(ts + i))),
+		    _mm_cmpeq_epi8(last, _mm_loadu_si128((const __m128i *)(ts + i + k - 1)))));
+		while (mask) {
+			if (memcmp(ts + i + __builtin_ctz(mask), ps, k) == 0) {
+				return 1;
+			}
+			mask &= mask - 1;
+		}
+	}
+	return simple_substr_scalar(ps, k, ts + i, n - i);
+}
+
+__attribute__((target("avx2")))
+int
+simple_substr_avx2(const unsigned char *ps, int k, const unsigned char *ts, long long n)
+{
+	const __m256i first = _mm256_set1_epi8((char)ps[0]);
+	const __m256i last = _mm256_set1_epi8((char)ps[k-1]);
+	unsigned int mask;
+	long long i;
+
+	for (i = 0; i + k - 1 + 32 <= n; i += 32) {
+		mask = (unsigned int)_mm256_movemask_epi8(_mm256_and_si256(
+		    _mm256_cmpeq_epi8(first, _mm256_loadu_si256((const __m256i *)(ts + i))),
+		    _mm256_cmpeq_epi8(last, _mm256_loadu_si256((const __m256i *)(ts + i + k - 1)))));
+		while (mask) {
+			if (memcmp(ts + i + __builtin_ctz(mask), ps, k) == 0) {
+				return 1;
+			}
+			mask &= mask - 1;
+		}
+	}
+	return simple_substr_scalar(ps, k, ts + i, n - i);
+}
+
+#elif defined(__ARM_NEON)
+
+int
+simple_substr_neon(const unsigned char *ps, int k, const unsigned char *ts, long long n)
+{
+	const uint8x16_t first = vdupq_n_u8(ps[0]);
+	const uint8x16_t last = vdupq_n_u8(ps[k-1]);
+	uint8x16_t eq;
+	uint8_t lanes[16];
+	long long i;
+	int b;
+
+	for (i = 0; i + k - 1 + 16 <= n; i += 16) {
+		eq = vandq_u8(vceqq_u8(first, vld1q_u8(ts + i)), 
+		    vceqq_u8(last, vld1q_u8(ts + i + k - 1)));
+		/* most blocks have no candidate at all */
+		if (vget_lane_u64(vreinterpret_u64_u8(vorr_u8(vget_low_u8(eq), vget_high_u8(eq))), 0) == 0) {
+			continue;
+		}
+		vst1q_u8(lanes, eq);
+		for (b = 0; b < 16; b++) {
+			if (lanes[b] && memcmp(ts + i + b, ps, k) == 0) {
+				return 1;
+			}
+		}
+	}
+	return simple_substr_scalar(ps, k, ts + i, n - i);
+}
+
+#endif
+
+/* the kernel simple_substr_match runs, picked once for the CPU we run on */
+substr_fn substr_kernel = NULL;
+pthread_once_t substr_once = PTHREAD_ONCE_INIT;
+
+static void
+substr_pick(void)
+{
+	substr_kernel = simple_substr_scalar;
+#if defined(__i386__) || defined(__x86_64__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		substr_kernel = simple_substr_avx2;
+	} else if (__builtin_cpu_supports("sse2")) {
+		substr_kernel = simple_substr_sse2;
+	}
+#elif defined(__ARM_NEON)
+	substr_kernel = simple_substr_neon;
+#endif
+}
+
+/* check if a query string ps (of length k) appears 
+	 in ts (of length n) as a substring 
+	 If so, return 1. Else return 0
+	 */
+int
+simple_substr_match(const unsigned char *ps,	/* the query string */
+						 int k, 					/* the length of the query string */
+						 const unsigned char *ts,	/* the document string (Y) */ 
+						 long long n				/* the length of the document Y */)
+{
+	if (k <= 0 || n < k) {
+		return k <= 0;
+	}
+	pthread_once(&substr_once, substr_pick);
+	return substr_kernel(ps, k, ts, n);
+}
+
+/* count the occurrences of ps (of length k) in ts (of length n), 
+   overlapping ones included, up to max */
+static long long
+simple_substr_count(const unsigned char *ps, int k, const unsigned char *ts, long long n, long long max)
+{
+	const unsigned char *p, *end;
+	long long cnt = 0;
+
+	if (n < k) {
+		return 0;
+	}
+	p = ts;
+	end = ts + (n - k + 1);
+	while (cnt < max && p < end && (p = memchr(p, ps[0], end - p)) != NULL) {
+		cnt += (memcmp(p, ps, k) == 0);
+		p++;
+	}
+	return cnt;
+}
+
+/* Look for ps (of length k, RK hash ps_hash) among the windows i..n-k of ts, 
+   where h is the RK hash of window i. Return 1 if one of them is ps. */
+RK_INLINE int
+rk_search_loop(const unsigned char *ps, int k, long long ps_hash, 
+    const unsigned char *ts, long long i, long long n, long long h, 
+    long long base_exp, int fam)
+{
+	for (;; i++) {
+		if (h == ps_hash && memcmp(ts + i, ps, k) == 0) {
+			return 1;
+		}
+		if (i >= n - k) {
+			return 0;
+		}
+		h = rk_roll_fam(h, ts[i], ts[i + k], base_exp, fam);
+	}
+}
+
+#define RK_SEARCH_PARAMS (const unsigned char *ps, int k, long long ps_hash, \
+    const unsigned char *ts, long long i, long long n, long long h, long long base_exp)
+/* the specialized loops take the constant K in place of the k they are passed */
+#define RK_SEARCH_GEN(K, FAM) \
+	((void)k, rk_search_loop(ps, (K), ps_hash, ts, i, n, h, RK_BASE_EXP((K), (FAM), base_exp), (FAM)))
+RK_SPECIALIZE(rk_search, int, RK_SEARCH_PARAMS, RK_SEARCH_GEN)
+
+static int
+rk_search_generic RK_SEARCH_PARAMS
+{
+	return rk_search_loop(ps, k, ps_hash, ts, i, n, h, base_exp, which_hash);
+}
+
+static int
+rk_search_dispatch RK_SEARCH_PARAMS
+{
+	switch (k) {
+		case 8: return rk_search_k8(ps, k, ps_hash, ts, i, n, h, base_exp);
+		case 16: return rk_search_k16(ps, k, ps_hash, ts, i, n, h, base_exp);
+		case 20: return rk_search_k20(ps, k, ps_hash, ts, i, n, h, base_exp);
+		case 32: return rk_search_k32(ps, k, ps_hash, ts, i, n, h, base_exp);
+		default: return rk_search_generic(ps, k, ps_hash, ts, i, n, h, base_exp);
+	}
+}
+
+/* Check if a query string ps (of length k) appears 
+	 in ts (of length n) as a substring using the rabin-karp algorithm
+	 If so, return 1. Else return 0
+
+
+	 In addition, print the hash value of ps (on one line)
+	 as well as the first 'PRINT_RK_HASH' hash values of ts (on another line)
+	 Example:
+	 $ ./rkmatch -t 1 -k 20 X Y
+	 4537305142160169
+	 1137948454218999 2816897116259975 4720517820514748 4092864945588237 3539905993503426 
+	 2021356707496909
+	 1137948454218999 2816897116259975 4720517820514748 4092864945588237 3539905993503426 
+	 0 chunks matched (out of 2), percentage: 0.00
+
+	Hint: Use "long long" type for the RK hash value.  Use printf("%lld", x) to print 
+	out x of long long type.
+	 */
+int
+rabin_karp_match(const unsigned char *ps,	/* the query string */
+								 int k, 					/* the length of the query string */
+								 const unsigned char *ts,	/* the document string (Y) */ 
+								 long long n				/* the length of the document Y */ )
+{
+	long long i;
+	int printed;
+	int response = 0;
+	long long base_exp;
+	long long ps_hash;
+	long long ts_hash;
+
+	if (n < k) {
+		return 0;
+	}
+
+	// get base^(k-1) and the initial hashes
+	base_exp = rk_base_exp(k);
+	ps_hash = rk_hash(ps, k);
+	ts_hash = rk_hash(ts, k);
+	printf("%llu\n", ps_hash);
+
+	// check the windows while there are hashes to print
+	for (i=printed=0; i <= n - k && printed <= PRINT_RK_HASH; i++) {
+		// print off the first PRINT_RK_HASH
+		if (printed < PRINT_RK_HASH) {
+			printf("%llu ", ts_hash);
+			printed++;
+		} else {
+			printf("\n");
+			printed++;
+		}
+
+		// if we have a match, let's be sure
+		if (ts_hash == ps_hash && memcmp(ts + i, ps, k) == 0) {
+			response = 1;
+		}
+
+		// remove the leading digit and add the next one
+		if (i < n - k) {
+			ts_hash = rk_roll(ts_hash, ts[i], ts[i + k], base_exp);
+		}
+	}
+
+	// then check the rest of them without printing
+	if (!response && i <= n - k) {
+		response = rk_search_dispatch(ps, k, ps_hash, ts, i, n, ts_hash, base_exp);
+	}
+	return response;
+}
+
+
+/* order chunks by RK hash, and chunks with the same hash by their offset in qs */
+static int
+chunk_cmp(const void *a, const void *b)
+{
+	const chunk_t *x = (const chunk_t *)a;
+	const chunk_t *y = (const chunk_t *)b;
+
+	if (x->hash != y->hash) {
+		return (x->hash < y->hash) ? -1 : 1;
+	}
+	return (x->off < y->off) ? -1 : (x->off > y->off);
+}
+
+/* the slot a chunk hash h starts probing the table at */
+static inline unsigned long long
+table_home(const batch_index *bi, long long h)
+{
+	return ((unsigned long long)h * 0x9E3779B97F4A7C15ULL) >> bi->table_shift;
+}
+
+/* the batch_index_build work that work_pool shares */
+typedef struct {
+	batch_index *bi;
+	long long nruns;        /* the chunks are hashed and sorted in this many runs */
+	chunk_t *src, *dst;     /* a merge round merges pairs of sorted runs of src into dst */
+	long long width;        /* number of runs in each of the sorted runs of src */
+	long long *order;       /* the number of each chunk in chunks[], in offset order */
+	long long *shard_start; /* table shard s inserts shard_chunks[shard_start[s]..shard_start[s+1]) */
+	long long *shard_chunks;/* chunk numbers (of order[]), by shard */
+	int shard_shift;        /* slots s << shard_shift up to the next shard's belong to shard s */
+	char *spilled;          /* chunks (of order[]) that ran past the end of their shard */
+} build_job;
+
+/* task: hash the chunks of run number 'task' and sort them */
+static void
+build_hash_task(void *ctx, long long task, int worker)
+{
+	build_job *job = (build_job *)ctx;
+	batch_index *bi = job->bi;
+	long long a = bi->nchunks * task / job->nruns;
+	long long b = bi->nchunks * (task + 1) / job->nruns;
+	long long i;
+
+	(void)worker;
+	for (i = a; i < b; i++) {
+		bi->chunks[i].hash = rk_hash(bi->qs + i*bi->k, bi->k);
+		bi->chunks[i].off = i*bi->k;
+	}
+	qsort(bi->chunks + a, b - a, sizeof(chunk_t), chunk_cmp);
+}
+
+/* task: merge the sorted runs number 2*task and 2*task+1 (of job->width 
+   runs each) of job->src into job->dst */
+static void
+build_merge_task(void *ctx, long long task, int worker)
+{
+	build_job *job = (build_job *)ctx;
+	long long n = job->bi->nchunks;
+	long long r0 = 2 * task * job->width;
+	long long r1 = (r0 + job->width < job->nruns) ? r0 + job->width : job->nruns;
+	long long r2 = (r0 + 2 * job->width < job->nruns) ? r0 + 2 * job->width : job->nruns;
+	long long i = n * r0 / job->nruns, mid = n * r1 / job->nruns, end = n * r2 / job->nruns;
+	long long j = mid, o = i;
+
+	(void)worker;
+	while (i < mid && j < end) {
+		job->dst[o++] = (chunk_cmp(&job->src[j], &job->src[i]) < 0) ? job->src[j++] : job->src[i++];
+	}
+	while (i < mid) {
+		job->dst[o++] = job->src[i++];
+	}
+	while (j < end) {
+		job->dst[o++] = job->src[j++];
+	}
+}
+
+/* Hash and sort the chunks of bi on the threads of work_pool: each run 
+   of consecutive chunks is hashed and sorted by one task, then the runs 
+   are merged pairwise in rounds. The chunks end up in the order one qsort
+   of all of them leaves, as (hash, off) orders them all. */
+static void
+batch_index_sort_parallel(batch_index *bi)
+{
+	build_job job;
+	chunk_t *tmp, *t;
+	size_t size = sizeof(chunk_t) * bi->nchunks;
+
+	job.bi = bi;
+	job.nruns = work_pool->nthreads;
+	pool_run(work_pool, build_hash_task, &job, job.nruns);
+
+	tmp = (chunk_t *)huge_alloc(size);
+	job.src = bi->chunks;
+	job.dst = tmp;
+	for (job.width = 1; job.width < job.nruns; job.width *= 2) {
+		pool_run(work_pool, build_merge_task, &job, (job.nruns + 2 * job.width - 1) / (2 * job.width));
+		t = job.src;
+		job.src = job.dst;
+		job.dst = t;
+	}
+	/* the sorted chunks are in src */
+	bi->chunks = job.src;
+	huge_free(job.dst, size);
+}
+
+/* task: insert the chunks of table shard number 'task' in offset order, 
+   probing no further than the last slot of the shard */
+static void
+build_table_task(void *ctx, long long task, int worker)
+{
+	build_job *job = (build_job *)ctx;
+	batch_index *bi = job->bi;
+	unsigned long long end = (unsigned long long)(task + 1) << job->shard_shift;
+	unsigned long long slot;
+	long long j, c, i;
+
+	(void)worker;
+	for (j = job->shard_start[task]; j < job->shard_start[task + 1]; j++) {
+		c = job->shard_chunks[j];
+		i = job->order[c];
+		for (slot = table_home(bi, bi->chunks[i].hash); slot < end && bi->table[slot].off >= 0; slot++)
+			;
+		if (slot == end) {
+			job->spilled[c] = 1;
+		} else {
+			bi->table[slot] = bi->chunks[i];
+		}
+	}
+}
+
+/* Insert the chunks of bi into its empty table of size slots on the threads
+   of work_pool. The table is split into shards of consecutive slots, and
+   each shard inserts the chunks whose home slot it holds, in offset order.
+   A chunk that finds its shard full from its home slot on spills; once all
+   shards are done, the spilled chunks are inserted in offset order on the
+   calling thread, probing on into the next shards. Chunks that carry the 
+   same hash have the same home slot, and once one of them spills so do all
+   later ones, so they are still met in offset order when probing. */
+static void
+batch_index_fill_table_parallel(batch_index *bi, long long *order, long long size)
+{
+	build_job job;
+	long long nshards = 1, s, c, i;
+	unsigned long long mask = size - 1, slot;
+	int shift = 64 - bi->table_shift;
+
+	/* a few shards per thread, of at least 64 slots */
+	while (nshards < 4 * work_pool->nthreads && (size / nshards) > 64) {
+		nshards <<= 1;
+		shift--;
+	}
+	job.bi = bi;
+	job.order = order;
+	job.shard_shift = shift;
+	job.shard_start = (long long *)calloc(nshards + 1, sizeof(long long));
+	job.shard_chunks = (long long *)malloc(sizeof(long long) * bi->nchunks);
+	job.spilled = (char *)calloc(bi->nchunks, 1);
+	if (!job.shard_start || !job.shard_chunks || !job.spilled) {
+		fprintf(stderr, " failed to allocate the table shards. No memory\n");
+		exit(1);
+	}
+
+	/* bucket the chunks by shard, in offset order */
+	for (c = 0; c < bi->nchunks; c++) {
+		job.shard_start[(table_home(bi, bi->chunks[order[c]].hash) >> shift) + 1]++;
+	}
+	for (s = 0; s < nshards; s++) {
+		job.shard_start[s + 1] += job.shard_start[s];
+	}
+	for (c = 0; c < bi->nchunks; c++) {
+		s = table_home(bi, bi->chunks[order[c]].hash) >> shift;
+		job.shard_chunks[job.shard_start[s]++] = c;
+	}
+	for (s = nshards; s > 0; s--) {
+		job.shard_start[s] = job.shard_start[s - 1];
+	}
+	job.shard_start[0] = 0;
+
+	pool_run(work_pool, build_table_task, &job, nshards);
+
+	for (c = 0; c < bi->nchunks; c++) {
+		if (!job.spilled[c]) {
+			continue;
+		}
+		i = order[c];
+		for (slot = table_home(bi, bi->chunks[i].hash); bi->table[slot].off >= 0; slot = (slot + 1) & mask)
+			;
+		bi->table[slot] = bi->chunks[i];
+	}
+
+	free(job.shard_start);
+	free(job.shard_chunks);
+	free(job.spilled);
+}
+
+/* task: add the hashes of run number 'task' of the chunks to the bloom filter */
+static void
+build_bloom_task(void *ctx, long long task, int worker)
+{
+	build_job *job = (build_job *)ctx;
+	batch_index *bi = job->bi;
+	long long a = bi->nchunks * task / job->nruns;
+	long long b = bi->nchunks * (task + 1) / job->nruns;
+	long long i;
+
+	(void)worker;
+	for (i = a; i < b; i++) {
+		bloom_add_concurrent(bi->bf, bi->chunks[i].hash);
+	}
+}
+
+/* Build the open-addressing table of bi's chunks: a flat array of 
+   (hash, off) slots, at most half full, with empty slots marked by off -1.
+   Collisions go to the next free slot (linear probing). The chunks are 
+   inserted in the order of their offsets, so the chunks that carry the 
+   same hash are met in that order when probing, just as in the sorted array. 
+   With work_pool, the table is filled in shards (see 
+   batch_index_fill_table_parallel). */
+static void
+batch_index_build_table(batch_index *bi)
+{
+	long long size = 8, i, c;
+	unsigned long long mask, slot;
+	long long *order;
+
+	bi->table_shift = 64 - 3;
+	while (size < 2 * bi->nchunks) {
+		size <<= 1;
+		bi->table_shift--;
+	}
+	mask = size - 1;
+	/* the table is probed at random, so it goes in huge pages */
+	bi->table = (chunk_t *)huge_alloc(sizeof(chunk_t) * size);
+	order = (long long *)malloc(sizeof(long long) * (bi->nchunks > 0 ? bi->nchunks : 1));
+	if (!order) {
+		fprintf(stderr, " failed to allocate a table of %lld slots. No memory\n", size);
+		exit(1);
+	}
+	for (i = 0; i < size; i++) {
+		bi->table[i].off = -1;
+	}
+
+	/* chunks[] is sorted by hash; insert them by offset instead */
+	for (i = 0; i < bi->nchunks; i++) {
+		order[bi->chunks[i].off / bi->k] = i;
+	}
+	if (work_pool && bi->nchunks >= BUILD_PARALLEL_MIN) {
+		batch_index_fill_table_parallel(bi, order, size);
+		free(order);
+		return;
+	}
+	for (c = 0; c < bi->nchunks; c++) {
+		i = order[c];
+		for (slot = table_home(bi, bi->chunks[i].hash); bi->table[slot].off >= 0; slot = (slot + 1) & mask)
+			;
+		bi->table[slot] = bi->chunks[i];
+	}
+	free(order);
+}
+
+/* Build the chunk-hash set of the query document: hash each of the m/k 
+   chunks of qs exactly once and sort them. With INDEX_BLOOM, insert them 
+   into a bloom filter of bsz bits, so that the scan can rule out most target
+   windows before looking them up with a binary search; with INDEX_TABLE,
+   insert them into an open-addressing table the scan looks them up in; with
+   INDEX_FILTERED, do both, but size the bloom filter from the number of 
+   chunks and filter_fp instead of by bsz, and block it by cache line, so 
+   that it stays in cache when the table does not.
+   With work_pool, each step is shared with its threads, and builds the 
+   same sorted chunks and bloom bitmap as on one thread. */
+void
+batch_index_build(batch_index *bi, 
+    long long bsz,           /* size of bloom filter bitmap (in bits) */
+    int k,                   /* chunk length */
+    const unsigned char *qs, /* query document (X) */
+    long long m              /* query document length */)
+{
+	long long i;
+	long long *hashes;
+	build_job job;
+
+	bi->k = k;
+	bi->qs = qs;
+	bi->base_exp = rk_base_exp(k);
+	bi->nchunks = m / k;
+	bi->chunks = (chunk_t *)huge_alloc(sizeof(chunk_t) * (bi->nchunks > 0 ? bi->nchunks : 1));
+
+	if (work_pool && bi->nchunks >= BUILD_PARALLEL_MIN) {
+		batch_index_sort_parallel(bi);
+	} else {
+		for (i = 0; i < bi->nchunks; i++) {
+			bi->chunks[i].hash = rk_hash(qs + i*k, k);
+			bi->chunks[i].off = i*k;
+		}
+		qsort(bi->chunks, bi->nchunks, sizeof(chunk_t), chunk_cmp);
+	}
+
+	bi->table = NULL;
+	bi->bf.buf = NULL;
+	bi->bf.bsz = 0;
+	bi->file.buf = NULL;
+	bi->next = NULL;
+	bi->chunk_base = 0;
+	bi->all_chunks = bi->nchunks;
+	if (index_type != INDEX_BLOOM) {
+		batch_index_build_table(bi);
+		if (index_type == INDEX_TABLE) {
+			return;
+		}
+		bsz = bloom_bits(bi->nchunks, filter_fp);
+	}
+
+	if (bsz < 8) {
+		bsz = 8;
+	}
+	if (index_type == INDEX_FILTERED || bloom_layout == BLOOM_BLOCKED || 
+	    (bloom_layout < 0 && bsz > BLOOM_BLOCKED_MIN_BITS)) {
+		bi->bf = bloom_init_blocked(bsz);
+	} else if (bloom_layout == BLOOM_COUNTING) {
+		bi->bf = bloom_init_counting(bsz);
+	} else {
+		bi->bf = bloom_init(bsz);
+	}
+	if (work_pool && bi->nchunks >= BUILD_PARALLEL_MIN && bi->bf.layout != BLOOM_COUNTING) {
+		/* bits are set with atomic ors, so the order of the chunks does not matter */
+		job.bi = bi;
+		job.nruns = work_pool->nthreads;
+		pool_run(work_pool, build_bloom_task, &job, job.nruns);
+		return;
+	}
+	hashes = (long long *)malloc(sizeof(long long) * (bi->nchunks > 0 ? bi->nchunks : 1));
+	if (!hashes) {
+		fprintf(stderr, " failed to allocate %lld hashes. No memory\n", bi->nchunks);
+		exit(1);
+	}
+	for (i = 0; i < bi->nchunks; i++) {
+		hashes[i] = bi->chunks[i].hash;
+	}
+	bloom_add_many(bi->bf, hashes, bi->nchunks);
+	free(hashes);
+}
+
+void
+batch_index_free(batch_index *bi)
+{
+	batch_index *seg, *next;
+
+	if (bi->file.buf) {
+		/* everything lives in the mapped file, but the later segments' structs */
+		for (seg = bi->next; seg; seg = next) {
+			next = seg->next;
+			free(seg);
+		}
+		bi->next = NULL;
+		unmap_file(&bi->file);
+		bi->chunks = NULL;
+		bi->table = NULL;
+		bi->bf.buf = NULL;
+		bi->nchunks = 0;
+		return;
+	}
+	huge_free(bi->chunks, sizeof(chunk_t) * (bi->nchunks > 0 ? bi->nchunks : 1));
+	bi->chunks = NULL;
+	bi->nchunks = 0;
+	if (bi->table) {
+		huge_free(bi->table, sizeof(chunk_t) << (64 - bi->table_shift));
+	}
+	bi->table = NULL;
+	bloom_free(&bi->bf);
+}
+
+/* write the len bytes at p to the index file f */
+static void
+index_write(FILE *f, const char *fname, const void *p, long long len)
+{
+	if (len > 0 && fwrite(p, 1, len, f) != (size_t)len) {
+		fprintf(stderr, "failed to write index file %s\n", fname);
+		exit(1);
+	}
+}
+
+/* pad f with zeros up to the next multiple of INDEX_ALIGN and return that offset */
+static long long
+index_align(FILE *f, const char *fname, long long off)
+{
+	static const char zeros[INDEX_ALIGN];
+	long long pad = (INDEX_ALIGN - off % INDEX_ALIGN) % INDEX_ALIGN;
+
+	index_write(f, fname, zeros, pad);
+	return off + pad;
+}
+
+/* the size of the bloom filter RKBATCH builds for a query of m characters (INDEX_BLOOM) */
+long long
+batch_bloom_bits(long long m, int k)
+{
+	return ((m*10/k)>>3)<<3;
+}
+
+/* Fill in the header of the data segment of bi, built from the query name
+   of m characters, with its sections at offsets from the segment start. */
+static void
+index_segment_header(index_header *h, const batch_index *bi, long long m, const char *name)
+{
+	long long off, table_size = 0;
+
+	memset(h, 0, sizeof(*h));
+	memcpy(h->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+	h->version = INDEX_VERSION;
+	h->k = bi->k;
+	h->hash = which_hash;
+	h->prime = BIG_PRIME;
+	h->index_type = index_type;
+	h->qlen = m;
+	h->nchunks = bi->nchunks;
+	h->bloom_bsz = bi->bf.buf ? bi->bf.bsz : 0;
+	h->bloom_layout = bi->bf.layout;
+	h->table_shift = bi->table_shift;
+	h->kind = SEG_DATA;
+	strncpy(h->name, name, INDEX_NAME_LEN - 1);
+	if (bi->table) {
+		table_size = 1LL << (64 - bi->table_shift);
+	}
+
+	/* lay the sections out behind the header */
+	off = sizeof(*h);
+	off = h->qs_off = (off + INDEX_ALIGN - 1) / INDEX_ALIGN * INDEX_ALIGN;
+	off += m;
+	off = h->chunks_off = (off + INDEX_ALIGN - 1) / INDEX_ALIGN * INDEX_ALIGN;
+	off += sizeof(chunk_t) * bi->nchunks;
+	if (h->bloom_bsz > 0) {
+		off = h->bloom_off = (off + INDEX_ALIGN - 1) / INDEX_ALIGN * INDEX_ALIGN;
+		off += bloom_bytes(bi->bf);
+	}
+	if (table_size > 0) {
+		off = h->table_off = (off + INDEX_ALIGN - 1) / INDEX_ALIGN * INDEX_ALIGN;
+		off += sizeof(chunk_t) * table_size;
+	}
+	h->seg_len = (off + INDEX_ALIGN - 1) / INDEX_ALIGN * INDEX_ALIGN;
+}
+
+/* write the data segment of bi to f, at a multiple of INDEX_ALIGN */
+static void
+index_write_segment(FILE *f, const char *fname, const batch_index *bi, long long m, const char *name)
+{
+	index_header h;
+	long long off;
+
+	index_segment_header(&h, bi, m, name);
+	index_write(f, fname, &h, sizeof(h));
+	off = index_align(f, fname, sizeof(h));
+	index_write(f, fname, bi->qs, m);
+	off = index_align(f, fname, off + m);
+	index_write(f, fname, bi->chunks, sizeof(chunk_t) * bi->nchunks);
+	off += sizeof(chunk_t) * bi->nchunks;
+	if (h.bloom_bsz > 0) {
+		off = index_align(f, fname, off);
+		index_write(f, fname, bi->bf.buf, bloom_bytes(bi->bf));
+		off += bloom_bytes(bi->bf);
+	}
+	if (h.table_off > 0) {
+		off = index_align(f, fname, off);
+		index_write(f, fname, bi->table, sizeof(chunk_t) << (64 - bi->table_shift));
+		off += sizeof(chunk_t) << (64 - bi->table_shift);
+	}
+	index_align(f, fname, off);
+}
+
+/* Save the batch index bi, built from the query name of m characters, to 
+   the index file fname as its only segment (see index_header). */
+void
+batch_index_save(const batch_index *bi, long long m, const char *fname, const char *name)
+{
+	FILE *f;
+
+	f = fopen(fname, "wb");
+	if (!f) {
+		perror("batch_index_save: fopen ");
+		exit(1);
+	}
+	index_write_segment(f, fname, bi, m, name);
+	if (fclose(f) != 0) {
+		perror("batch_index_save: fclose ");
+		exit(1);
+	}
+}
+
+/* Read the header of the segment at off in the mapped index file fm into h
+   (a version 1 header is completed as the one data segment of its file),
+   and exit if it is not one. Return 0 if the segment does not end in fm:
+   past the first segment, that is one being appended as fm was mapped, or
+   one whose append was cut short. */
+static int
+index_header_at(const file_map *fm, long long off, const char *fname, index_header *h)
+{
+	long long v1_len = (long long)offsetof(index_header, kind);
+
+	if (off > 0 && fm->len - off < (long long)sizeof(*h)) {
+		return 0;
+	}
+	if (fm->len - off < v1_len) {
+		fprintf(stderr, "%s is not an index file\n", fname);
+		exit(1);
+	}
+	memset(h, 0, sizeof(*h));
+	memcpy(h, fm->buf + off, v1_len);
+	if (memcmp(h->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0) {
+		fprintf(stderr, "%s is not an index file\n", fname);
+		exit(1);
+	}
+	if (h->version == 1 && off == 0) {
+		h->kind = SEG_DATA;
+		h->seg_len = fm->len;
+		return 1;
+	}
+	if (h->version != INDEX_VERSION) {
+		fprintf(stderr, "%s has index version %lld, expected %d\n", fname, h->version, INDEX_VERSION);
+		exit(1);
+	}
+	if (fm->len - off < (long long)sizeof(*h)) {
+		fprintf(stderr, "index file %s is truncated or corrupt\n", fname);
+		exit(1);
+	}
+	memcpy(h, fm->buf + off, sizeof(*h));
+	if (h->seg_len < (long long)sizeof(*h) || h->seg_len % INDEX_ALIGN != 0 || 
+	    (h->kind != SEG_DATA && h->kind != SEG_TOMBSTONE)) {
+		fprintf(stderr, "index file %s is corrupt\n", fname);
+		exit(1);
+	}
+	if (h->seg_len > fm->len - off) {
+		if (off > 0) {
+			return 0;
+		}
+		fprintf(stderr, "index file %s is truncated or corrupt\n", fname);
+		exit(1);
+	}
+	return 1;
+}
+
+/* the segments of a mapped index file */
+typedef struct {
+	index_header first; /* header of the first segment, whose settings all share */
+	long long ndata;    /* number of data segments */
+	long long nlive;    /* number of them without a tombstone */
+	long long end;      /* end of the last whole segment */
+	long long *off;     /* offset of each data segment in the file */
+	char *dead;         /* whether each data segment has a tombstone */
+} index_log;
+
+/* Read the segments of the mapped index file fm into lg. A segment that 
+   does not end in fm is left out, so that a run may read the file while 
+   another appends to it (-A, -X) without locking it. */
+static void
+index_log_read(index_log *lg, const file_map *fm, const char *fname)
+{
+	index_header h;
+	long long off, cap = 0;
+
+	lg->ndata = lg->nlive = 0;
+	lg->off = NULL;
+	lg->dead = NULL;
+	if (fm->len == 0) {
+		fprintf(stderr, "%s is not an index file\n", fname);
+		exit(1);
+	}
+	for (off = 0; off < fm->len && index_header_at(fm, off, fname, &h); off += h.seg_len) {
+		if (off == 0) {
+			lg->first = h;
+		} else if (h.k != lg->first.k || h.hash != lg->first.hash || 
+		    h.prime != lg->first.prime || h.index_type != lg->first.index_type) {
+			fprintf(stderr, "index file %s mixes segments of different settings\n", fname);
+			exit(1);
+		}
+		if (h.kind == SEG_TOMBSTONE) {
+			if (h.target < 0 || h.target >= lg->ndata) {
+				fprintf(stderr, "index file %s is truncated or corrupt\n", fname);
+				exit(1);
+			}
+			lg->nlive -= !lg->dead[h.target];
+			lg->dead[h.target] = 1;
+			continue;
+		}
+		if (lg->ndata == cap) {
+			cap = cap ? 2 * cap : 16;
+			lg->off = (long long *)realloc(lg->off, sizeof(long long) * cap);
+			lg->dead = (char *)realloc(lg->dead, cap);
+			if (!lg->off || !lg->dead) {
+				fprintf(stderr, " failed to allocate %lld segments. No memory\n", cap);
+				exit(1);
+			}
+		}
+		lg->off[lg->ndata] = off;
+		lg->dead[lg->ndata] = 0;
+		lg->ndata++;
+		lg->nlive++;
+	}
+	lg->end = off;
+}
+
+static void
+index_log_free(index_log *lg)
+{
+	free(lg->off);
+	free(lg->dead);
+}
+
+/* Open the index file fname for writing and take the lock -A, -X and -C 
+   hold while they change it; readers take none (see index_log_read). 
+   -C replaces the file by renaming a new one over it, so the lock is only
+   good once it is on the file fname names.
+   Return the locked descriptor (closing it releases the lock), or -1 if
+   there is no file fname. */
+static int
+index_lock(const char *fname)
+{
+	struct stat held, named;
+	int fd;
+
+	for (;;) {
+		fd = open(fname, O_RDWR);
+		if (fd < 0) {
+			if (errno == ENOENT) {
+				return -1;
+			}
+			perror("rkmatch: open index ");
+			exit(1);
+		}
+		if (flock(fd, LOCK_EX) != 0) {
+			perror("rkmatch: lock index ");
+			exit(1);
+		}
+		if (fstat(fd, &held) == 0 && stat(fname, &named) == 0 && 
+		    held.st_dev == named.st_dev && held.st_ino == named.st_ino) {
+			return fd;
+		}
+		close(fd);
+	}
+}
+
+/* Set k, the hash family, the prime and the index type from the index file
+   fname, as a segment appended to it must have them. Return k, or 0 if 
+   there is no such file. */
+int
+batch_index_settings(const char *fname)
+{
+	file_map fm;
+	index_log lg;
+
+	if (access(fname, F_OK) != 0) {
+		return 0;
+	}
+	map_file(fname, &fm);
+	index_log_read(&lg, &fm, fname);
+	which_hash = (int)lg.first.hash;
+	BIG_PRIME = lg.first.prime;
+	index_type = (int)lg.first.index_type;
+	index_log_free(&lg);
+	unmap_file(&fm);
+	return (int)lg.first.k;
+}
+
+/* Append bi, built from the query name of m characters, to the index file 
+   fname as a new data segment, creating the file if there is none. Only 
+   bi is written, so this costs as much as the new query, not the whole 
+   index. Return the number of live segments fname then has. */
+long long
+batch_index_append(const batch_index *bi, long long m, const char *fname, const char *name)
+{
+	file_map fm;
+	index_log lg;
+	FILE *f;
+	int fd;
+
+	fd = index_lock(fname);
+	if (fd < 0) {
+		batch_index_save(bi, m, fname, name);
+		return 1;
+	}
+	map_file(fname, &fm);
+	index_log_read(&lg, &fm, fname);
+	if (lg.first.version != INDEX_VERSION) {
+		fprintf(stderr, "%s has index version %lld; rewrite it with -C before appending\n", 
+		        fname, lg.first.version);
+		exit(1);
+	}
+	if (bi->k != lg.first.k) {
+		fprintf(stderr, "%s has chunks of %lld characters, not %d\n", fname, lg.first.k, bi->k);
+		exit(1);
+	}
+	/* write over what is left of an append that was cut short */
+	f = fdopen(fd, "r+b");
+	if (!f || ftruncate(fd, lg.end) != 0 || fseek(f, lg.end, SEEK_SET) != 0) {
+		perror("batch_index_append: seek ");
+		exit(1);
+	}
+	index_write_segment(f, fname, bi, m, name);
+	if (fclose(f) != 0) {
+		perror("batch_index_append: fclose ");
+		exit(1);
+	}
+	unmap_file(&fm);
+	index_log_free(&lg);
+	return lg.nlive + 1;
+}
+
+/* delete the data segment number seg of the index file fname by appending a tombstone for it */
+void
+batch_index_delete(const char *fname, long long seg)
+{
+	file_map fm;
+	index_log lg;
+	index_header h;
+	FILE *f;
+	int fd;
+
+	fd = index_lock(fname);
+	if (fd < 0) {
+		perror("rkmatch: open index ");
+		exit(1);
+	}
+	map_file(fname, &fm);
+	index_log_read(&lg, &fm, fname);
+	if (seg < 0 || seg >= lg.ndata || lg.dead[seg]) {
+		fprintf(stderr, "%s has no segment %lld to delete\n", fname, seg);
+		exit(1);
+	}
+	if (lg.first.version != INDEX_VERSION) {
+		fprintf(stderr, "%s has index version %lld; rewrite it with -C before deleting\n", 
+		        fname, lg.first.version);
+		exit(1);
+	}
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+	h.version = INDEX_VERSION;
+	h.k = lg.first.k;
+	h.hash = lg.first.hash;
+	h.prime = lg.first.prime;
+	h.index_type = lg.first.index_type;
+	h.kind = SEG_TOMBSTONE;
+	h.seg_len = (sizeof(h) + INDEX_ALIGN - 1) / INDEX_ALIGN * INDEX_ALIGN;
+	h.target = seg;
+
+	f = fdopen(fd, "r+b");
+	if (!f || ftruncate(fd, lg.end) != 0 || fseek(f, lg.end, SEEK_SET) != 0) {
+		perror("batch_index_delete: seek ");
+		exit(1);
+	}
+	index_write(f, fname, &h, sizeof(h));
+	index_align(f, fname, sizeof(h));
+	if (fclose(f) != 0) {
+		perror("batch_index_delete: fclose ");
+		exit(1);
+	}
+	unmap_file(&fm);
+	index_log_free(&lg);
+}
+
+/* print the data segments of the index file fname, numbered as -X takes them */
+void
+batch_index_list(const char *fname)
+{
+	file_map fm;
+	index_log lg;
+	index_header h;
+	long long s;
+
+	map_file(fname, &fm);
+	index_log_read(&lg, &fm, fname);
+	for (s = 0; s < lg.ndata; s++) {
+		index_header_at(&fm, lg.off[s], fname, &h);
+		printf("segment %lld: %s, %lld chunks%s\n", s, h.name[0] ? h.name : "-", 
+		       h.nchunks, lg.dead[s] ? " (deleted)" : "");
+	}
+	index_log_free(&lg);
+	unmap_file(&fm);
+}
+
+/* point seg at the data segment with header h at base in a mapped index file */
+static void
+index_segment_map(batch_index *seg, const file_map *fm, long long off, const index_header *h, const char *fname)
+{
+	const unsigned char *base = fm->buf + off;
+	long long table_size = 0;
+
+	if (h->table_off > 0) {
+		table_size = 1LL << (64 - h->table_shift);
+	}
+	seg->bf.bsz = h->bloom_bsz;
+	seg->bf.layout = (int)h->bloom_layout;
+	if (h->k < 1 || h->qlen < 0 || h->nchunks != h->qlen / h->k || 
+	    h->qs_off + h->qlen > h->seg_len || 
+	    h->chunks_off + (long long)sizeof(chunk_t) * h->nchunks > h->seg_len ||
+	    (h->bloom_off > 0 && h->bloom_off + bloom_bytes(seg->bf) > h->seg_len) ||
+	    (h->table_off > 0 && h->table_off + (long long)sizeof(chunk_t) * table_size > h->seg_len)) {
+		fprintf(stderr, "index file %s is truncated or corrupt\n", fname);
+		exit(1);
+	}
+	seg->k = (int)h->k;
+	seg->qs = base + h->qs_off;
+	seg->nchunks = h->nchunks;
+	seg->chunks = (chunk_t *)(base + h->chunks_off);
+	seg->bf.buf = (h->bloom_off > 0) ? (char *)(base + h->bloom_off) : NULL;
+	seg->table = (h->table_off > 0) ? (chunk_t *)(base + h->table_off) : NULL;
+	seg->table_shift = (int)h->table_shift;
+	seg->base_exp = rk_base_exp(seg->k);
+	seg->file.buf = NULL;
+	seg->next = NULL;
+}
+
+/* Map the index file fname read-only and point bi into it, as a list of 
+   its live segments. The index decides the chunk length, the hash family,
+   the prime and the index type, so these globals are set from it. 
+   Return the total length of the live segments' queries. */
+long long
+batch_index_load(batch_index *bi, const char *fname)
+{
+	file_map fm;
+	index_log lg;
+	index_header h;
+	batch_index *seg, **tail = NULL;
+	long long s, qlen = 0, nchunks = 0;
+
+	map_file(fname, &fm);
+	index_log_read(&lg, &fm, fname);
+	if (fm.mapped) {
+		/* lookups jump around the index */
+		madvise(fm.buf, fm.len, MADV_RANDOM);
+	}
+
+	which_hash = (int)lg.first.hash;
+	BIG_PRIME = lg.first.prime;
+	index_type = (int)lg.first.index_type;
+
+	/* with no live segment, an empty index */
+	memset(bi, 0, sizeof(*bi));
+	bi->k = (int)lg.first.k;
+	bi->base_exp = rk_base_exp(bi->k);
+	for (s = 0; s < lg.ndata; s++) {
+		if (lg.dead[s]) {
+			continue;
+		}
+		index_header_at(&fm, lg.off[s], fname, &h);
+		if (h.nchunks == 0) {
+			/* nothing to probe */
+			continue;
+		}
+		if (!tail) {
+			seg = bi;
+		} else if (!(seg = (batch_index *)malloc(sizeof(batch_index)))) {
+			fprintf(stderr, " failed to allocate a segment. No memory\n");
+			exit(1);
+		}
+		index_segment_map(seg, &fm, lg.off[s], &h, fname);
+		seg->chunk_base = nchunks;
+		if (tail) {
+			*tail = seg;
+		}
+		tail = &seg->next;
+		nchunks += h.nchunks;
+		qlen += h.qlen;
+	}
+	bi->all_chunks = nchunks;
+	bi->file = fm;
+	index_log_free(&lg);
+	return qlen;
+}
+
+/* Rewrite the index file fname as one data segment built from the queries
+   of its live segments, one after another. Each query is cut to its whole
+   chunks, so the new segment has the same chunks as the live ones. The new
+   file is written next to fname and renamed over it, so that runs that 
+   have the old one mapped keep reading it. */
+void
+batch_index_compact(const char *fname)
+{
+	batch_index old, merged;
+	const batch_index *seg;
+	unsigned char *qs;
+	long long m = 0, nseg = 0;
+	char tmp[4096], name[INDEX_NAME_LEN];
+	int fd, layout;
+
+	fd = index_lock(fname);
+	if (fd < 0) {
+		perror("rkmatch: open index ");
+		exit(1);
+	}
+	batch_index_load(&old, fname);
+	qs = (unsigned char *)malloc(old.all_chunks * old.k + 1);
+	if (!qs) {
+		fprintf(stderr, " failed to allocate %lld bytes. No memory\n", old.all_chunks * old.k + 1);
+		exit(1);
+	}
+	for (seg = &old; seg && seg->qs; seg = seg->next, nseg++) {
+		memcpy(qs + m, seg->qs, seg->nchunks * seg->k);
+		m += seg->nchunks * seg->k;
+	}
+	/* keep the filter layout the segments were built with, not the one of this run */
+	layout = bloom_layout;
+	if (old.bf.buf) {
+		bloom_layout = old.bf.layout;
+	}
+	batch_index_build(&merged, batch_bloom_bits(m, old.k), old.k, qs, m);
+	bloom_layout = layout;
+
+	snprintf(tmp, sizeof(tmp), "%s.%d.tmp", fname, (int)getpid());
+	snprintf(name, sizeof(name), "(%lld segment%s compacted)", nseg, nseg == 1 ? "" : "s");
+	batch_index_save(&merged, m, tmp, name);
+	if (rename(tmp, fname) != 0) {
+		perror("rkmatch: rename index ");
+		unlink(tmp);
+		exit(1);
+	}
+
+	batch_index_free(&merged);
+	batch_index_free(&old);
+	free(qs);
+	close(fd);
+}
+
+/* return the position of the first chunk whose hash is >= h */
+static long long
+batch_index_lookup(const batch_index *bi, long long h)
+{
+	long long lo = 0, hi = bi->nchunks;
+
+	while (lo < hi) {
+		long long mid = lo + (hi - lo) / 2;
+		if (bi->chunks[mid].hash < h) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/* append the match of the chunk at qoff by the target window win to hl */
+static void
+hit_list_add(hit_list *hl, long long qoff, const unsigned char *win)
+{
+	if (hl->n == hl->cap) {
+		hl->cap = hl->cap ? 2 * hl->cap : 1024;
+		hl->hit = (hit_t *)realloc(hl->hit, sizeof(hit_t) * hl->cap);
+		if (!hl->hit) {
+			fprintf(stderr, " failed to allocate %lld matches. No memory\n", hl->cap);
+			exit(1);
+		}
+	}
+	hl->hit[hl->n].qoff = qoff;
+	hl->hit[hl->n].win = win;
+	hl->n++;
+}
+
+/* Compare the chunk q with the target window win, both k characters long,
+   and count the comparison in sc (with its time, if phases are timed). */
+RK_INLINE int
+batch_verify(const unsigned char *q, const unsigned char *win, int k, scan_counters *sc)
+{
+	struct timespec ts0;
+	int eq;
+
+	sc->n[CT_VERIFIES]++;
+	if (!timing && !stats) {
+		eq = (memcmp(q, win, k) == 0);
+	} else {
+		ts0 = phase_start();
+		eq = (memcmp(q, win, k) == 0);
+		sc->verify_ns += timediff_ns(phase_start(), ts0);
+	}
+	sc->n[CT_VERIFIED] += eq;
+	return eq;
+}
+
+/* Probe one target window win (k characters, RK hash h): if h passes the
+   bloom filter, compare win against the chunks carrying that hash and credit
+   the first one that is equal and not yet matched (matched[] is indexed by
+   chunk number, i.e. off/k). With the table, the chunks carrying h are 
+   found by probing from h's home slot up to the first empty one instead,
+   after passing the bloom filter if there is one (INDEX_FILTERED).
+   Count the window in sc as a hash hit if any chunk carries h.
+   Return 1 if a chunk was newly matched. */
+RK_INLINE int
+batch_index_resolve_k(const batch_index *bi, long long h, 
+    const unsigned char *win, char *matched, int k, scan_counters *sc)
+{
+	long long j, c;
+	unsigned long long slot, mask;
+	const chunk_t *e;
+	int hit = 0;
+
+	if (bi->table) {
+		mask = (~0ULL) >> bi->table_shift;
+		for (slot = table_home(bi, h); (e = &bi->table[slot])->off >= 0; slot = (slot + 1) & mask) {
+			if (e->hash != h) {
+				continue;
+			}
+			hit = 1;
+			c = e->off / k;
+			if (!matched[c] && batch_verify(bi->qs + e->off, win, k, sc)) {
+				matched[c] = 1;
+				if (sc->hits) {
+					hit_list_add(sc->hits, e->off, win);
+				}
+				break;
+			}
+		}
+		sc->n[CT_HASH_HITS] += hit;
+		return e->off >= 0;
+	}
+
+	for (j = batch_index_lookup(bi, h); j < bi->nchunks && bi->chunks[j].hash == h; j++) {
+		hit = 1;
+		c = bi->chunks[j].off / k;
+		if (!matched[c] && batch_verify(bi->qs + bi->chunks[j].off, win, k, sc)) {
+			matched[c] = 1;
+			if (sc->hits) {
+				hit_list_add(sc->hits, bi->chunks[j].off, win);
+			}
+			sc->n[CT_HASH_HITS]++;
+			return 1;
+		}
+	}
+	sc->n[CT_HASH_HITS] += hit;
+	return 0;
+}
+
+RK_INLINE int
+batch_index_probe_k(const batch_index *bi, long long h, 
+    const unsigned char *win, char *matched, int k, scan_counters *sc)
+{
+	if (bi->bf.buf) {
+		if (!bloom_query(bi->bf, h)) {
+			return 0;
+		}
+		sc->n[CT_BLOOM_PASS]++;
+	}
+	return batch_index_resolve_k(bi, h, win, matched, k, sc);
+}
+
+/* Probe the window win in the segments of bi, each with its own match 
+   flags, up to the first one that credits a chunk: a window credits one
+   chunk in all, as it would in the one segment compacting them builds. */
+static inline int
+batch_index_probe(const batch_index *bi, long long h, 
+    const unsigned char *win, char *matched, scan_counters *sc)
+{
+	const batch_index *seg;
+
+	sc->n[CT_WINDOWS]++;
+	for (seg = bi; seg; seg = seg->next) {
+		if (batch_index_probe_k(seg, h, win, matched + seg->chunk_base, bi->k, sc)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* prefetch the cache line that a probe of h in bi will look at first */
+static inline void
+batch_index_prefetch(const batch_index *bi, long long h)
+{
+	if (bi->bf.buf) {
+		bloom_prefetch(bi->bf, h);
+	} else {
+		__builtin_prefetch(&bi->table[table_home(bi, h)]);
+	}
+}
+
+/* add the counters of a finished scan to counters[] and to the verify phase */
+void
+scan_counters_flush(const scan_counters *sc, int k)
+{
+	int ct;
+
+	if (!timing && !stats) {
+		return;
+	}
+	for (ct = 0; ct < NCOUNTERS; ct++) {
+		__sync_fetch_and_add(&counters[ct], sc->n[ct]);
+	}
+	__sync_fetch_and_add(&phase_ns[PH_VERIFY], sc->verify_ns);
+	__sync_fetch_and_add(&phase_bytes[PH_VERIFY], sc->n[CT_VERIFIES] * k);
+}
+
+/* Probe a batch of cnt consecutive windows, window b starting at win + b
+   with RK hash hs[b], in the segments of bi; a window goes on to the next
+   segment only if it credited no chunk in this one (see batch_index_probe).
+   The caller has prefetched the cache line each hash looks at first in the
+   first segment (see batch_roll_loop). Return the number of chunks newly 
+   marked in matched[]. */
+RK_INLINE long long
+batch_probe_windows(const batch_index *bi, const long long *hs, int cnt, 
+    const unsigned char *win, char *matched, scan_counters *sc, int k)
+{
+	unsigned char passed[(PROBE_BATCH + 7) / 8];
+	int pass[PROBE_BATCH]; /* windows of the batch that passed the bloom filter */
+	int open[PROBE_BATCH]; /* windows of the batch that credited no chunk yet */
+	long long hq[PROBE_BATCH];
+	const long long *hp = hs;
+	long long num_matched = 0;
+	const batch_index *seg;
+	int b, o, npass, nopen, nleft;
+
+	for (b = 0; b < cnt; b++) {
+		open[b] = b;
+	}
+	nopen = cnt;
+	for (seg = bi; seg && nopen > 0; seg = seg->next) {
+		if (seg != bi) {
+			/* the hashes of the open windows, in window order */
+			for (o = 0; o < nopen; o++) {
+				hq[o] = hs[open[o]];
+				batch_index_prefetch(seg, hq[o]);
+			}
+			hp = hq;
+		}
+
+		npass = nopen;
+		if (seg->bf.buf) {
+			bloom_query_many(seg->bf, hp, nopen, passed);
+			for (o = npass = 0; o < nopen; o++) {
+				if (passed[o >> 3] & (0x80 >> (o & 7))) {
+					pass[npass++] = open[o];
+					if (seg->table) {
+						__builtin_prefetch(&seg->table[table_home(seg, hp[o])]);
+					}
+				}
+			}
+			sc->n[CT_BLOOM_PASS] += npass;
+		} else {
+			for (o = 0; o < nopen; o++) {
+				pass[o] = open[o];
+			}
+		}
+
+		/* resolve the windows that passed, in window order; those that
+		   credit a chunk are done, the rest stay open for the next segment */
+		for (o = b = nleft = 0; o < nopen; o++) {
+			if (b < npass && pass[b] == open[o]) {
+				b++;
+				if (batch_index_resolve_k(seg, hs[open[o]], win + open[o], 
+				    matched + seg->chunk_base, k, sc)) {
+					num_matched++;
+					continue;
+				}
+			}
+			open[nleft++] = open[o];
+		}
+		nopen = nleft;
+	}
+	sc->n[CT_WINDOWS] += cnt;
+	return num_matched;
+}
+
+/* The rolling part of batch_index_scan_block: probe the windows ending at
+   buf[i..n), where h is the RK hash of the window ending at buf[i-1] and
+   every window is k characters long. Store the last hash in *hp and return 
+   the number of chunks newly marked in matched[].
+
+   The windows are probed PROBE_BATCH at a time, so that their random 
+   accesses into the index overlap instead of stalling one after another:
+   the hashes of a batch are rolled first and the cache line each will look 
+   at first is prefetched (its bloom filter block or its home slot in the 
+   table), then the windows that pass the bloom filter have their table 
+   slots prefetched, and only then are they resolved, in window order, so 
+   that chunks are credited exactly as one probe at a time would. 
+   An index of several segments has each batch probed in one segment after
+   another, each taking the windows that credited no chunk in the ones 
+   before; the first one's cache lines are prefetched as the hashes roll.
+   The windows and what became of them are counted in sc. */
+RK_INLINE long long
+batch_roll_loop(const batch_index *bi, const unsigned char *buf, 
+    long long i, long long n, long long h, long long *hp, char *matched, 
+    scan_counters *sc, int k, long long base_exp, int fam)
+{
+	long long hs[PROBE_BATCH];
+	long long num_matched = 0;
+	int b, cnt;
+
+	while (i < n) {
+		cnt = (n - i < PROBE_BATCH) ? (int)(n - i) : PROBE_BATCH;
+		for (b = 0; b < cnt; b++) {
+			h = rk_roll_fam(h, buf[i + b - k], buf[i + b], base_exp, fam);
+			hs[b] = h;
+			batch_index_prefetch(bi, h);
+		}
+		num_matched += batch_probe_windows(bi, hs, cnt, buf + i - k + 1, matched, sc, k);
+		i += cnt;
+	}
+	*hp = h;
+	return num_matched;
+}
+
+#define BATCH_ROLL_PARAMS (const batch_index *bi, const unsigned char *buf, \
+    long long i, long long n, long long h, long long *hp, char *matched, \
+    scan_counters *sc)
+#define BATCH_ROLL_GEN(K, FAM) \
+	batch_roll_loop(bi, buf, i, n, h, hp, matched, sc, (K), RK_BASE_EXP((K), (FAM), bi->base_exp), (FAM))
+RK_SPECIALIZE(batch_roll, long long, BATCH_ROLL_PARAMS, BATCH_ROLL_GEN)
+
+static long long
+batch_roll_generic BATCH_ROLL_PARAMS
+{
+	return batch_roll_loop(bi, buf, i, n, h, hp, matched, sc, bi->k, bi->base_exp, which_hash);
+}
+
+static long long
+batch_roll_dispatch BATCH_ROLL_PARAMS
+{
+	switch (bi->k) {
+		case 8: return batch_roll_k8(bi, buf, i, n, h, hp, matched, sc);
+		case 16: return batch_roll_k16(bi, buf, i, n, h, hp, matched, sc);
+		case 20: return batch_roll_k20(bi, buf, i, n, h, hp, matched, sc);
+		case 32: return batch_roll_k32(bi, buf, i, n, h, hp, matched, sc);
+		default: return batch_roll_generic(bi, buf, i, n, h, hp, matched, sc);
+	}
+}
+
+void
+scan_state_init(scan_state *st)
+{
+	st->hash = 0;
+	st->seen = 0;
+}
+
+/* Feed the characters buf[start..n) of the target to a batch scan that has 
+   already consumed st->seen characters, and probe every window that ends in
+   them. The scan carries its rolling hash in st, so a target can be fed in 
+   blocks: buf[0..start) must hold the last min(st->seen, k) characters fed 
+   before, which are the characters the windows reach back into.
+   If hits is not NULL, every chunk match is also appended to it.
+   Return the number of chunks newly marked in matched[]. */
+long long
+batch_index_scan_block(const batch_index *bi, 
+    scan_state *st,           /* rolling state, updated in place */
+    const unsigned char *buf, /* the previous characters followed by the new ones */
+    long long start,          /* offset of the first new character in buf */
+    long long n,              /* length of buf */
+    char *matched,            /* per-chunk match flags, updated in place */
+    hit_list *hits            /* chunk matches, appended to, or NULL */)
+{
+	long long i = start, rolled;
+	int k = bi->k;
+	long long h = st->hash;
+	long long num_matched = 0;
+	scan_counters sc;
+
+	if (bi->all_chunks == 0) {
+		st->seen += n - start;
+		return 0;
+	}
+	memset(&sc, 0, sizeof(sc));
+	sc.hits = hits;
+
+	/* the first k characters of the target only fill the window */
+	for (; i < n && st->seen < k; i++, st->seen++) {
+		h = rk_append(h, buf[i]);
+		if (st->seen == k - 1) {
+			num_matched += batch_index_probe(bi, h, buf + i - k + 1, matched, &sc);
+		}
+	}
+
+	/* from then on every character drops buf[i-k] and completes a window */
+	rolled = i;
+	if (i < n) {
+		num_matched += batch_roll_dispatch(bi, buf, i, n, h, &h, matched, &sc);
+	}
+	st->seen += n - rolled;
+	st->hash = h;
+	scan_counters_flush(&sc, k);
+	return num_matched;
+}
+
+/* Roll a single RK hash across ts and probe every one of its n-k+1 windows 
+   against the bloom filter. Only a window that passes the filter is looked
+   up in the chunk-hash set (see batch_index_probe).
+   Return the number of chunks newly marked in matched[]. */
+long long
+batch_index_scan(const batch_index *bi, 
+    const unsigned char *ts, /* to-be-matched document (Y) */
+    long long n,             /* to-be-matched document length */
+    char *matched            /* per-chunk match flags, updated in place */)
+{
+	scan_state st;
+	struct timespec ts0;
+	long long num_matched;
+
+	ts0 = phase_start();
+	scan_state_init(&st);
+	num_matched = batch_index_scan_block(bi, &st, ts, 0, n, matched, NULL);
+	phase_end(PH_SCAN, ts0, n);
+	return num_matched;
+}
+
+/* Compute the HASH_W64 hashes hs[b] = pb[b] - pa[b]*bk of a batch of 
+   PROBE_BATCH windows from the prefix hashes at their two ends (see 
+   rk_window_fam); this is the reference the vector kernels below must 
+   agree with. */
+typedef void (*windows_fn)(const long long *pb, const long long *pa, long long bk, long long *hs);
+
+void
+rk_windows_w64_scalar(const long long *pb, const long long *pa, long long bk, long long *hs)
+{
+	int b;
+
+	for (b = 0; b < PROBE_BATCH; b++) {
+		hs[b] = rk_window_fam(pb[b], pa[b], bk, HASH_W64);
+	}
+}
+
+/* The vector kernels compute the windows of a batch 2, 4 or 8 at a time.
+   Short of AVX-512DQ there is no 64-bit multiplication of vector lanes, so
+   the low 64 bits of pa[b]*bk are put together from 32-bit halves: 
+   lo(a)*lo(b) + ((lo(a)*hi(b) + hi(a)*lo(b)) << 32). */
+#if defined(__i386__) || defined(__x86_64__)
+
+__attribute__((target("sse2")))
+void
+rk_windows_w64_sse2(const long long *pb, const long long *pa, long long bk, long long *hs)
+{
+	const __m128i b_lo = _mm_set1_epi64x(bk & 0xffffffffLL);
+	const __m128i b_hi = _mm_set1_epi64x((long long)((unsigned long long)bk >> 32));
+	__m128i a, prod, cross;
+	int b;
+
+	for (b = 0; b < PROBE_BATCH; b += 2) {
+		a = _mm_loadu_si128((const __m128i *)(pa + b));
+		cross = _mm_add_epi64(_mm_mul_epu32(a, b_hi), _mm_mul_epu32(_mm_srli_epi64(a, 32), b_lo));
+		prod = _mm_add_epi64(_mm_mul_epu32(a, b_lo), _mm_slli_epi64(cross, 32));
+		_mm_storeu_si128((__m128i *)(hs + b), 
+		    _mm_sub_epi64(_mm_loadu_si128((const __m128i *)(pb + b)), prod));
+	}
+}
+
+__attribute__((target("avx2")))
+void
+rk_windows_w64_avx2(const long long *pb, const long long *pa, long long bk, long long *hs)
+{
+	const __m256i b_lo = _mm256_set1_epi64x(bk & 0xffffffffLL);
+	const __m256i b_hi = _mm256_set1_epi64x((long long)((unsigned long long)bk >> 32));
+	__m256i a, prod, cross;
+	int b;
+
+	for (b = 0; b < PROBE_BATCH; b += 4) {
+		a = _mm256_loadu_si256((const __m256i *)(pa + b));
+		cross = _mm256_add_epi64(_mm256_mul_epu32(a, b_hi), _mm256_mul_epu32(_mm256_srli_epi64(a, 32), b_lo));
+		prod = _mm256_add_epi64(_mm256_mul_epu32(a, b_lo), _mm256_slli_epi64(cross, 32));
+		_mm256_storeu_si256((__m256i *)(hs + b), 
+		    _mm256_sub_epi64(_mm256_loadu_si256((const __m256i *)(pb + b)), prod));
+	}
+}
+
+__attribute__((target("avx512f,avx512dq")))
+void
+rk_windows_w64_avx512(const long long *pb, const long long *pa, long long bk, long long *hs)
+{
+	const __m512i vbk = _mm512_set1_epi64(bk);
+	int b;
+
+	for (b = 0; b < PROBE_BATCH; b += 8) {
+		_mm512_storeu_si512((void *)(hs + b), _mm512_sub_epi64(_mm512_loadu_si512((const void *)(pb + b)), 
+		    _mm512_mullo_epi64(_mm512_loadu_si512((const void *)(pa + b)), vbk)));
+	}
+}
+
+#elif defined(__ARM_NEON)
+
+void
+rk_windows_w64_neon(const long long *pb, const long long *pa, long long bk, long long *hs)
+{
+	const uint32x2_t b_lo = vdup_n_u32((uint32_t)bk);
+	const uint32x2_t b_hi = vdup_n_u32((uint32_t)((unsigned long long)bk >> 32));
+	uint64x2_t a, prod;
+	uint32x2_t a_lo, a_hi, cross;
+	int b;
+
+	for (b = 0; b < PROBE_BATCH; b += 2) {
+		a = vld1q_u64((const uint64_t *)(pa + b));
+		a_lo = vmovn_u64(a);
+		a_hi = vshrn_n_u64(a, 32);
+		cross = vadd_u32(vmul_u32(a_lo, b_hi), vmul_u32(a_hi, b_lo));
+		prod = vaddq_u64(vmull_u32(a_lo, b_lo), vshlq_n_u64(vmovl_u32(cross), 32));
+		vst1q_u64((uint64_t *)(hs + b), vsubq_u64(vld1q_u64((const uint64_t *)(pb + b)), prod));
+	}
+}
+
+#endif
+
+/* the kernel batch_index_scan_multi computes HASH_W64 windows with, picked
+   once for the CPU we run on */
+windows_fn windows_kernel = NULL;
+pthread_once_t windows_once = PTHREAD_ONCE_INIT;
+
+static void
+windows_pick(void)
+{
+	windows_kernel = rk_windows_w64_scalar;
+#if defined(__i386__) || defined(__x86_64__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512dq")) {
+		windows_kernel = rk_windows_w64_avx512;
+	} else if (__builtin_cpu_supports("avx2")) {
+		windows_kernel = rk_windows_w64_avx2;
+	} else if (__builtin_cpu_supports("sse2")) {
+		windows_kernel = rk_windows_w64_sse2;
+	}
+#elif defined(__ARM_NEON)
+	windows_kernel = rk_windows_w64_neon;
+#endif
+}
+
+/* Without a 128-bit product, the mmul of a prefix hash by bk (both up to 
+   the prime) in a HASH_MOD window hash takes mmul's slow way; each index
+   then rolls its own hash instead, whose products have one small factor. */
+#ifdef __SIZEOF_INT128__
+#define MULTI_ROLL_MOD 0
+#else
+#define MULTI_ROLL_MOD 1
+#endif
+
+/* The scan of batch_index_scan_multi for hash family fam, see there. 
+   pre[] has room for kmax + MULTI_BLOCK + PROBE_BATCH prefix hashes. */
+RK_INLINE void
+batch_multi_loop(const batch_index *bis, int nk, const unsigned char *ts, 
+    long long n, char **matched, long long *num_matched, scan_counters *sc, 
+    long long *pre, int kmax, int fam)
+{
+	long long bk[MULTI_K_MAX], rh[MULTI_K_MAX], hs[PROBE_BATCH];
+	const long long *q;
+	long long i, end, p;
+	int j, k, b, cnt;
+	int roll = MULTI_ROLL_MOD && fam == HASH_MOD;
+
+	for (j = 0; j < nk; j++) {
+		bk[j] = rk_append_fam(bis[j].base_exp, 0, fam);
+		rh[j] = 0;
+	}
+	pre[kmax] = 0;
+	for (i = 0; i < n; i = end) {
+		end = (n - i < MULTI_BLOCK) ? n : i + MULTI_BLOCK;
+		/* pre[kmax + t] is the hash of ts[0 .. i+t) */
+		for (p = i; p < end && !roll; p++) {
+			pre[kmax + 1 + p - i] = rk_append_fam(pre[kmax + p - i], ts[p], fam);
+		}
+
+		for (j = 0; j < nk; j++) {
+			k = bis[j].k;
+			if (bis[j].all_chunks == 0) {
+				continue;
+			}
+			for (p = (i > k - 1) ? i : k - 1; p < end; p += cnt) {
+				/* the windows ending at ts[p .. p+cnt) */
+				cnt = (end - p < PROBE_BATCH) ? (int)(end - p) : PROBE_BATCH;
+				q = pre + kmax + 1 + p - i;
+				/* always a whole batch, which the vector kernels take */
+				if (fam == HASH_W64) {
+					windows_kernel(q, q - k, bk[j], hs);
+				} else if (roll) {
+					for (b = 0; b < cnt; b++) {
+						rh[j] = (p + b == k - 1) ? rk_hash(ts, k) : 
+						    rk_roll_fam(rh[j], ts[p + b - k], ts[p + b], bis[j].base_exp, fam);
+						hs[b] = rh[j];
+					}
+				} else {
+					for (b = 0; b < PROBE_BATCH; b++) {
+						hs[b] = rk_window_fam(q[b], q[b - k], bk[j], fam);
+					}
+				}
+				for (b = 0; b < cnt; b++) {
+					batch_index_prefetch(&bis[j], hs[b]);
+				}
+				num_matched[j] += batch_probe_windows(&bis[j], hs, cnt, 
+				    ts + p - k + 1, matched[j], &sc[j], k);
+			}
+		}
+
+		/* the windows of the next block reach back kmax characters into this one */
+		memmove(pre, pre + (end - i), sizeof(long long) * (kmax + 1));
+	}
+}
+
+/* Match ts against nk indexes of the same query built for different chunk
+   lengths (at most MULTI_K_MAX), in a single pass over ts. Rather than one
+   rolling hash per index, a single chain of prefix hashes is run along ts, 
+   MULTI_BLOCK characters at a time, and the hash of any window is the 
+   difference of the prefix hashes at its two ends (rk_window_fam): so 
+   every character costs one append to the chain and one multiplication per
+   index, and the window hashes of a batch are independent of each other: 
+   under HASH_W64 a vector kernel (windows_kernel) computes them in lanes
+   (HASH_MOD rolls a hash per index where there is no 128-bit product). 
+   Index j's windows are probed as batch_index_scan probes them, so 
+   num_matched[j] (the number of chunks newly marked in matched[j]) is what
+   batch_index_scan returns for it. */
+void
+batch_index_scan_multi(const batch_index *bis, int nk, 
+    const unsigned char *ts, /* to-be-matched document (Y) */
+    long long n,             /* to-be-matched document length */
+    char **matched,          /* per-index per-chunk match flags, updated in place */
+    long long *num_matched   /* per-index results */)
+{
+	scan_counters sc[MULTI_K_MAX];
+	struct timespec ts0;
+	long long *pre;
+	int j, kmax = 0;
+
+	ts0 = phase_start();
+	pthread_once(&windows_once, windows_pick);
+	memset(sc, 0, sizeof(sc));
+	for (j = 0; j < nk; j++) {
+		num_matched[j] = 0;
+		if (bis[j].k > kmax) {
+			kmax = bis[j].k;
+		}
+	}
+	pre = (long long *)calloc(kmax + MULTI_BLOCK + PROBE_BATCH, sizeof(long long));
+	if (!pre) {
+		fprintf(stderr, " failed to allocate %d prefix hashes. No memory\n", kmax + MULTI_BLOCK + PROBE_BATCH);
+		exit(1);
+	}
+	switch (which_hash) {
+		case HASH_M61:
+			batch_multi_loop(bis, nk, ts, n, matched, num_matched, sc, pre, kmax, HASH_M61);
+			break;
+		case HASH_W64:
+			batch_multi_loop(bis, nk, ts, n, matched, num_matched, sc, pre, kmax, HASH_W64);
+			break;
+		default:
+			batch_multi_loop(bis, nk, ts, n, matched, num_matched, sc, pre, kmax, HASH_MOD);
+			break;
+	}
+	for (j = 0; j < nk; j++) {
+		scan_counters_flush(&sc[j], bis[j].k);
+	}
+	free(pre);
+	phase_end(PH_SCAN, ts0, n);
+}
+
+/* Matching regions are written by a region_writer, in one of two formats:
+   REGION_NDJSON is a line {"doc":d,"query_offset":q,"target_offset":t,"length":l}
+   per region, REGION_BINARY is the 8 bytes REGION_MAGIC followed by the four
+   numbers of each region as native long longs. d numbers the docs from 0, 
+   and the offsets are into the normalized query and doc. 
+   If the writer has offset maps, the offsets are into the original files 
+   instead, where the two sides of a region may differ in length: a line is
+   {"doc":d,"query_offset":q,"query_length":lq,"target_offset":t,"target_length":lt},
+   and a binary file starts with REGION_ORIG_MAGIC and has these five numbers
+   per region. The records are formatted into a buffer of REGION_BUF bytes 
+   that is written out whenever it fills up. */
+enum regionformat { REGION_NDJSON=0, REGION_BINARY};
+#define REGION_MAGIC "RKREGION"
+#define REGION_ORIG_MAGIC "RKREGORG"
+#define REGION_BUF (1 << 20)
+
+typedef struct {
+	int fd;
+	int format;
+	char *buf;
+	long long len;     /* bytes pending in buf */
+	offset_map *qmap;  /* the query's offset map, or NULL for normalized offsets */
+	offset_map *tmap;  /* the current doc's offset map, if qmap is not NULL */
+} region_writer;
+
+/* a matching region: the length bytes at qoff in the query equal those at toff in the doc */
+typedef struct {
+	long long qoff;
+	long long toff;
+	long long len;
+} region_t;
+
+static void
+region_flush(region_writer *w)
+{
+	long long done = 0, r;
+
+	if (w->fd == 1) {
+		/* keep the order of the lines printed to stdout */
+		fflush(stdout);
+	}
+	while (done < w->len) {
+		r = write(w->fd, w->buf + done, w->len - done);
+		if (r < 0) {
+			perror("rkmatch: write regions ");
+			exit(1);
+		}
+		done += r;
+	}
+	w->len = 0;
+}
+
+/* Start writing regions to fname ("-" is stdout) in the given format, with
+   original offsets if qmap is not NULL (w->tmap must then be set to the 
+   offset map of each doc before its regions are written). */
+void
+region_writer_open(region_writer *w, const char *fname, int format, offset_map *qmap)
+{
+	if (strcmp(fname, "-") == 0) {
+		w->fd = 1;
+	} else if ((w->fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+		perror("rkmatch: open regions ");
+		exit(1);
+	}
+	w->format = format;
+	w->len = 0;
+	w->qmap = qmap;
+	w->tmap = NULL;
+	w->buf = (char *)malloc(REGION_BUF);
+	if (!w->buf) {
+		fprintf(stderr, " failed to allocate %d bytes. No memory\n", REGION_BUF);
+		exit(1);
+	}
+	if (format == REGION_BINARY) {
+		memcpy(w->buf, qmap ? REGION_ORIG_MAGIC : REGION_MAGIC, 8);
+		w->len = 8;
+	}
+}
+
+void
+region_writer_close(region_writer *w)
+{
+	region_flush(w);
+	if (w->fd != 1) {
+		close(w->fd);
+	}
+	free(w->buf);
+}
+
+/* format the non-negative v in decimal at p, return the number of digits */
+static int
+put_decimal(char *p, long long v)
+{
+	char tmp[20];
+	int n = 0, i;
+
+	do {
+		tmp[n++] = '0' + v % 10;
+		v /= 10;
+	} while (v > 0);
+	for (i = 0; i < n; i++) {
+		p[i] = tmp[n - 1 - i];
+	}
+	return n;
+}
+
+/* append the field ,"name":v (without the comma if first) of a record at p */
+static char *
+put_field(char *p, const char *name, long long v, int first)
+{
+	int len = strlen(name);
+
+	if (!first) {
+		*p++ = ',';
+	}
+	*p++ = '"';
+	memcpy(p, name, len);
+	p += len;
+	*p++ = '"';
+	*p++ = ':';
+	return p + put_decimal(p, v);
+}
+
+/* append the region r of doc d to w */
+void
+region_write(region_writer *w, long long d, const region_t *r)
+{
+	long long rec[5];
+	int nrec;
+	char *p;
+
+	if (w->len + 256 > REGION_BUF) {
+		region_flush(w);
+	}
+	rec[0] = d;
+	if (w->qmap) {
+		/* the last character of a region maps to the last of its original */
+		rec[1] = offset_map_lookup(w->qmap, r->qoff);
+		rec[2] = offset_map_lookup(w->qmap, r->qoff + r->len - 1) + 1 - rec[1];
+		rec[3] = offset_map_lookup(w->tmap, r->toff);
+		rec[4] = offset_map_lookup(w->tmap, r->toff + r->len - 1) + 1 - rec[3];
+		nrec = 5;
+	} else {
+		rec[1] = r->qoff;
+		rec[2] = r->toff;
+		rec[3] = r->len;
+		nrec = 4;
+	}
+	if (w->format == REGION_BINARY) {
+		memcpy(w->buf + w->len, rec, sizeof(long long) * nrec);
+		w->len += sizeof(long long) * nrec;
+		return;
+	}
+	p = w->buf + w->len;
+	*p++ = '{';
+	p = put_field(p, "doc", rec[0], 1);
+	if (w->qmap) {
+		p = put_field(p, "query_offset", rec[1], 0);
+		p = put_field(p, "query_length", rec[2], 0);
+		p = put_field(p, "target_offset", rec[3], 0);
+		p = put_field(p, "target_length", rec[4], 0);
+	} else {
+		p = put_field(p, "query_offset", rec[1], 0);
+		p = put_field(p, "target_offset", rec[2], 0);
+		p = put_field(p, "length", rec[3], 0);
+	}
+	*p++ = '}';
+	*p++ = '\n';
+	w->len = p - w->buf;
+}
+
+/* Scan ts like batch_index_scan, and write to w the matching regions of 
+   doc d: each chunk match the scan credits is grown to the left and to the
+   right for as long as the query qs (of length m) and ts agree, comparing 
+   them where they lie. A match that falls inside a region already written 
+   (on the same diagonal, i.e. with the same toff - qoff) is not grown 
+   again, so a run of matching chunks comes out as one maximal region.
+   Return the number of chunks newly marked in matched[]. */
+long long
+batch_index_scan_regions(const batch_index *bi, 
+    long long m,             /* query document length */
+    const unsigned char *ts, /* to-be-matched document (Y) */
+    long long n,             /* to-be-matched document length */
+    char *matched,           /* per-chunk match flags, updated in place */
+    region_writer *w,        /* where the regions go */
+    long long d              /* number of the doc */)
+{
+	scan_state st;
+	struct timespec ts0;
+	long long num_matched, i, j, na = 0, cap = 16, q, t, left, right;
+	hit_list hits = {NULL, 0, 0};
+	const unsigned char *qs = bi->qs;
+	int k = bi->k;
+	region_t *open_r; /* the regions written that reach past the current match */
+
+	ts0 = phase_start();
+	scan_state_init(&st);
+	num_matched = batch_index_scan_block(bi, &st, ts, 0, n, matched, &hits);
+
+	open_r = (region_t *)malloc(sizeof(region_t) * cap);
+	if (!open_r) {
+		fprintf(stderr, " failed to allocate %lld regions. No memory\n", cap);
+		exit(1);
+	}
+	for (i = 0; i < hits.n; i++) {
+		q = hits.hit[i].qoff;
+		t = hits.hit[i].win - ts;
+		/* the matches come in target order, so a region that ends before t is done */
+		for (j = 0; j < na; ) {
+			if (open_r[j].toff + open_r[j].len <= t) {
+				open_r[j] = open_r[--na];
+			} else {
+				j++;
+			}
+		}
+		for (j = 0; j < na; j++) {
+			if (open_r[j].toff - open_r[j].qoff == t - q && 
+			    t + k <= open_r[j].toff + open_r[j].len) {
+				break;
+			}
+		}
+		if (j < na) {
+			continue;
+		}
+
+		for (left = 0; left < q && left < t && qs[q - left - 1] == ts[t - left - 1]; left++)
+			;
+		for (right = k; q + right < m && t + right < n && qs[q + right] == ts[t + right]; right++)
+			;
+		if (na == cap) {
+			cap *= 2;
+			open_r = (region_t *)realloc(open_r, sizeof(region_t) * cap);
+			if (!open_r) {
+				fprintf(stderr, " failed to allocate %lld regions. No memory\n", cap);
+				exit(1);
+			}
+		}
+		open_r[na].qoff = q - left;
+		open_r[na].toff = t - left;
+		open_r[na].len = left + right;
+		region_write(w, d, &open_r[na]);
+		na++;
+	}
+	phase_end(PH_SCAN, ts0, n);
+
+	free(open_r);
+	free(hits.hit);
+	return num_matched;
+}
+
+/* Scan the target read from fd in blocks of block_size bytes, with memory
+   bounded by the block size no matter how long the target is. Each block is
+   normalized on its own, carrying the whitespace-collapse state across
+   blocks, and scanned behind the last k normalized characters of the 
+   previous block, carrying the rolling hash across blocks. 
+   Return the number of chunks newly marked in matched[]. */
+long long
+batch_index_scan_fd(const batch_index *bi, 
+    int fd,                  /* the to-be-matched document (Y), read until EOF */
+    long long block_size,    /* number of bytes to read at once */
+    char *matched            /* per-chunk match flags, updated in place */)
+{
+	unsigned char *raw, *buf;
+	long long keep = 0, len;
+	long long num_matched = 0;
+	ssize_t r;
+	norm_state ns;
+	scan_state st;
+	struct timespec ts0;
+
+	raw = (unsigned char *)malloc(block_size);
+	buf = (unsigned char *)malloc(bi->k + block_size + 2);
+	if (!raw || !buf) {
+		fprintf(stderr, " failed to allocate %lld bytes. No memory\n", 2*block_size + bi->k);
+		exit(1);
+	}
+
+	norm_state_init(&ns);
+	scan_state_init(&st);
+	while (1) {
+		ts0 = phase_start();
+		r = read(fd, raw, block_size);
+		if (r < 0) {
+			perror("batch_index_scan_fd: read ");
+			exit(1);
+		}
+		phase_end(PH_READ, ts0, r);
+		if (r == 0) {
+			break;
+		}
+
+		ts0 = phase_start();
+		len = keep + normalize_stream(&ns, buf + keep, raw, r);
+		phase_end(PH_NORMALIZE, ts0, r);
+
+		ts0 = phase_start();
+		num_matched += batch_index_scan_block(bi, &st, buf, keep, len, matched, NULL);
+		phase_end(PH_SCAN, ts0, len - keep);
+
+		/* keep the characters the next block's first windows reach back into */
+		keep = (len < bi->k) ? len : bi->k;
+		memmove(buf, buf + len - keep, keep);
+	}
+
+	free(raw);
+	free(buf);
+	return num_matched;
+}
+
+/* Merge the match flags that separate scans of parts of one target left in
+   parts[0..nparts) for the chunks of the segment seg into matched[], 
+   exactly as one scan of the whole target would have set them. A scan 
+   credits the first not yet matched chunk among identical ones, trying the
+   segments in order, so a group of identical chunks (in seg and the 
+   segments after it) ends up with as many matches as its windows had 
+   occurrences, capped at its size, and these go to its first chunks in 
+   segment and then offset order, as they would in the one segment that 
+   compacting the index builds. grouped[] marks the chunks already merged.
+   All flags are indexed from the start of the whole index. Return the 
+   number of chunks marked in matched[]. */
+static long long
+batch_segment_merge(const batch_index *seg, char **parts, int nparts, 
+    char *grouped, char *matched)
+{
+	long long a, b, e, f, g, h, cnt, size, num_matched = 0;
+	const chunk_t *ch = seg->chunks;
+	const batch_index *s;
+	const unsigned char *q;
+	int k = seg->k;
+	int r;
+
+	for (a = 0; a < seg->nchunks; a = b) {
+		/* identical chunks have the same hash, so they are next to each other */
+		for (b = a + 1; b < seg->nchunks && ch[b].hash == ch[a].hash; b++)
+			;
+		h = ch[a].hash;
+		for (e = a; e < b; e++) {
+			if (grouped[seg->chunk_base + ch[e].off / k]) {
+				continue;
+			}
+			/* count the matches of the group of chunks identical to chunk e */
+			q = seg->qs + ch[e].off;
+			cnt = size = 0;
+			for (s = seg; s; s = s->next) {
+				for (f = (s == seg) ? e : batch_index_lookup(s, h); 
+				    f < s->nchunks && s->chunks[f].hash == h; f++) {
+					g = s->chunk_base + s->chunks[f].off / k;
+					if (!grouped[g] && memcmp(s->qs + s->chunks[f].off, q, k) == 0) {
+						grouped[g] = 1;
+						size++;
+						for (r = 0; r < nparts; r++) {
+							cnt += parts[r][g];
+						}
+					}
+				}
+			}
+			if (cnt > size) {
+				cnt = size;
+			}
+			num_matched += cnt;
+			/* each segment's part of the group is in offset order; the 
+			   group's first cnt chunks are matched */
+			for (s = seg; s; s = s->next) {
+				for (f = (s == seg) ? e : batch_index_lookup(s, h); 
+				    f < s->nchunks && s->chunks[f].hash == h; f++) {
+					g = s->chunk_base + s->chunks[f].off / k;
+					if (grouped[g] == 1) {
+						if (cnt > 0) {
+							matched[g] = 1;
+							cnt--;
+						}
+						grouped[g] = 2;
+					}
+				}
+			}
+		}
+	}
+	return num_matched;
+}
+
+/* Merge the match flags that separate scans of parts of one target left in
+   parts[0..nparts) into matched[], segment by segment (see batch_segment_merge).
+   Return the number of chunks marked in matched[]. */
+long long
+batch_index_merge(const batch_index *bi, 
+    char **parts,  /* match flags of the separate scans */
+    int nparts,    /* number of separate scans */
+    char *matched  /* the merged match flags */)
+{
+	const batch_index *seg;
+	long long num_matched = 0;
+	char *grouped;
+
+	grouped = (char *)calloc(bi->all_chunks > 0 ? bi->all_chunks : 1, 1);
+	if (!grouped) {
+		fprintf(stderr, " failed to allocate %lld bytes. No memory\n", bi->all_chunks);
+		exit(1);
+	}
+	memset(matched, 0, bi->all_chunks);
+	for (seg = bi; seg; seg = seg->next) {
+		num_matched += batch_segment_merge(seg, parts, nparts, grouped, matched);
+	}
+	free(grouped);
+	return num_matched;
+}
+
+/* the RKBATCH work that the -j thread pool shares */
+typedef struct {
+	const batch_index *bi;
+	char **names;            /* all docs */
+	long long stream_block;  /* stream docs in blocks of this size if > 0 */
+	long long *results;      /* number of chunks matched in each doc */
+	char **matched;          /* match flags of each worker, or of each range */
+	int first;               /* first doc of a batch of whole-doc tasks */
+	const unsigned char *ts; /* the loaded doc that range tasks split */
+	long long n;             /* its length */
+	long long nranges;       /* number of ranges it is split into */
+	arena *arenas;           /* where each worker loads its docs */
+} batch_job;
+
+/* task: load (or stream) and scan the doc names[first+task] by itself */
+static void
+batch_doc_task(void *ctx, long long task, int worker)
+{
+	batch_job *job = (batch_job *)ctx;
+	int d = job->first + (int)task;
+	char *matched = job->matched[worker];
+	unsigned char *doc;
+	long long doc_len;
+	int fd;
+
+	memset(matched, 0, job->bi->all_chunks);
+	prefetch_advance(prefetcher, d);
+	if (job->stream_block > 0) {
+		fd = open_doc(job->names[d]);
+		if (fd < 0) {
+			perror("rkmatch: open ");
+			exit(1);
+		}
+		job->results[d] = batch_index_scan_fd(job->bi, fd, job->stream_block, matched);
+		close(fd);
+	} else {
+		load_doc(&job->arenas[worker], job->names[d], &doc, &doc_len);
+		job->results[d] = batch_index_scan(job->bi, doc, doc_len, matched);
+		arena_reset(&job->arenas[worker]);
+	}
+}
+
+/* task: scan the windows starting in range number 'task' of the loaded doc;
+   a range of windows reaches k-1 characters into the next range */
+static void
+batch_range_task(void *ctx, long long task, int worker)
+{
+	batch_job *job = (batch_job *)ctx;
+	long long nwin = job->n - job->bi->k + 1;
+	long long a = nwin * task / job->nranges;
+	long long b = nwin * (task + 1) / job->nranges;
+
+	(void)worker;
+	memset(job->matched[task], 0, job->bi->all_chunks);
+	if (b > a) {
+		batch_index_scan(job->bi, job->ts + a, b - a + job->bi->k - 1, job->matched[task]);
+	}
+}
+
+/* a doc is split into ranges if it is a regular file of at least PARALLEL_SPLIT_MIN bytes */
+static int
+doc_is_large(const char *fname, long long stream_block)
+{
+	struct stat st;
+
+	if (stream_block > 0 || strcmp(fname, "-") == 0 || stat(fname, &st) != 0) {
+		return 0;
+	}
+	return S_ISREG(st.st_mode) && st.st_size >= PARALLEL_SPLIT_MIN;
+}
+
+/* Match the ndocs docs names[] against the shared, read-only batch index 
+   on the threads of pool, and store the number of chunks matched in each 
+   doc in results[]. Small docs are scanned one per thread; a large doc is 
+   loaded once and its windows are split between the threads, whose match
+   flags are merged afterwards (see batch_index_merge). */
+void
+batch_match_parallel(const batch_index *bi, 
+    char **names, int ndocs, 
+    long long stream_block, 
+    thread_pool *pool, 
+    long long *results)
+{
+	batch_job job;
+	char *merged;
+	unsigned char *doc;
+	long long doc_len;
+	int i, d, e;
+
+	job.bi = bi;
+	job.names = names;
+	job.stream_block = stream_block;
+	job.results = results;
+	job.nranges = pool->nthreads;
+	job.matched = (char **)malloc(sizeof(char *) * pool->nthreads);
+	job.arenas = (arena *)malloc(sizeof(arena) * pool->nthreads);
+	merged = (char *)malloc(bi->all_chunks > 0 ? bi->all_chunks : 1);
+	if (!job.matched || !job.arenas || !merged) {
+		fprintf(stderr, " failed to allocate match flags. No memory\n");
+		exit(1);
+	}
+	for (i = 0; i < pool->nthreads; i++) {
+		job.matched[i] = (char *)malloc(bi->all_chunks > 0 ? bi->all_chunks : 1);
+		if (!job.matched[i]) {
+			fprintf(stderr, " failed to allocate %lld bytes. No memory\n", bi->all_chunks);
+			exit(1);
+		}
+		arena_init(&job.arenas[i], DOC_ARENA_BLOCK);
+	}
+
+	for (d = 0; d < ndocs; ) {
+		/* the run of small docs starting at d */
+		for (e = d; e < ndocs && !doc_is_large(names[e], stream_block); e++)
+			;
+		if (e > d) {
+			job.first = d;
+			pool_run(pool, batch_doc_task, &job, e - d);
+			d = e;
+		}
+		if (d < ndocs) {
+			/* the calling thread is worker 0, which loads nothing during the ranges */
+			prefetch_advance(prefetcher, d);
+			load_doc(&job.arenas[0], names[d], &doc, &doc_len);
+			results[d] = 0;
+			if (doc_len >= bi->k) {
+				job.ts = doc;
+				job.n = doc_len;
+				pool_run(pool, batch_range_task, &job, job.nranges);
+				results[d] = batch_index_merge(bi, job.matched, job.nranges, merged);
+			}
+			arena_reset(&job.arenas[0]);
+			d++;
+		}
+	}
+
+	for (i = 0; i < pool->nthreads; i++) {
+		free(job.matched[i]);
+		arena_free(&job.arenas[i]);
+	}
+	free(job.matched);
+	free(job.arenas);
+	free(merged);
+}
+
+/* a growing list of winnowing fingerprints: the RK hash of a k-gram and its offset */
+typedef struct {
+	chunk_t *fp;
+	long long n;
+	long long cap;
+} fp_list;
+
+static void
+fp_list_add(fp_list *l, long long hash, long long off)
+{
+	if (l->n == l->cap) {
+		l->cap = l->cap ? 2 * l->cap : 1024;
+		l->fp = (chunk_t *)realloc(l->fp, sizeof(chunk_t) * l->cap);
+		if (!l->fp) {
+			fprintf(stderr, " failed to allocate %lld fingerprints. No memory\n", l->cap);
+			exit(1);
+		}
+	}
+	l->fp[l->n].hash = hash;
+	l->fp[l->n].off = off;
+	l->n++;
+}
+
+/* Winnow s (of length n): roll the RK hash of the k-gram at every offset, 
+   and from every w consecutive k-gram hashes select the smallest one 
+   (the rightmost one if several are smallest), appending each selected 
+   k-gram to out once. Any substring of at least w+k-1 characters that s 
+   shares with another string therefore yields a fingerprint that both 
+   strings select, wherever it lies. If s has fewer than w k-grams, the 
+   smallest of them is selected. The window minimum is kept in a deque of 
+   the k-grams that may still become one, in increasing order of hash, 
+   held in a ring whose size is a power of two no smaller than w. */
+void
+winnow(const unsigned char *s, long long n, int k, int w, fp_list *out)
+{
+	chunk_t *dq;        /* the deque */
+	long long mask;     /* its ring size minus 1 */
+	long long head = 0; /* index of its front, which is the window minimum */
+	long long len = 0;  /* number of entries in it */
+	long long last = -1;  /* offset of the last selected k-gram */
+	long long base_exp, h = 0, i;
+	chunk_t *front;
+
+	if (n < k) {
+		return;
+	}
+	for (mask = 1; mask < w; mask <<= 1)
+		;
+	dq = (chunk_t *)malloc(sizeof(chunk_t) * mask);
+	mask--;
+	if (!dq) {
+		fprintf(stderr, " failed to allocate %d fingerprints. No memory\n", w);
+		exit(1);
+	}
+	base_exp = rk_base_exp(k);
 	for (i = 0; i < k; i++) {
-		ps_hash = madd(mmul(base, ps_hash), ps[i]);
-		ts_hash = madd(mmul(base, ts_hash), ts[i]);
+		h = rk_append(h, s[i]);
+	}
+
+	for (i = 0; ; i++) {
+		/* k-gram i-w leaves the window */
+		if (len > 0 && dq[head].off <= i - w) {
+			head = (head + 1) & mask;
+			len--;
+		}
+		/* and k-gram i enters it; those behind it with no smaller hash 
+		   can no longer be a minimum (compared unsigned, as HASH_W64 wraps) */
+		while (len > 0 && 
+		    (unsigned long long)dq[(head + len - 1) & mask].hash >= (unsigned long long)h) {
+			len--;
+		}
+		dq[(head + len) & mask].hash = h;
+		dq[(head + len) & mask].off = i;
+		len++;
+
+		front = &dq[head];
+		if (i >= w - 1 && front->off != last) {
+			fp_list_add(out, front->hash, front->off);
+			last = front->off;
+		}
+		if (i == n - k) {
+			break;
+		}
+		h = rk_roll(h, s[i], s[i + k], base_exp);
+	}
+	if (last < 0) {
+		fp_list_add(out, dq[head].hash, dq[head].off);
+	}
+	free(dq);
+}
+
+/* Winnow the query qs (of length m) and the target ts (of length n), and 
+   count the query fingerprints whose k-gram also is a fingerprint of the 
+   target. The query fingerprints are sorted by hash and each target 
+   fingerprint is looked up with a binary search and verified byte by byte.
+   Store the number of query fingerprints in *total. */
+long long
+winnow_match(const unsigned char *qs, long long m, 
+    const unsigned char *ts, long long n, 
+    int k, int w, long long *total)
+{
+	fp_list q = {NULL, 0, 0}, t = {NULL, 0, 0};
+	long long i, j, lo, hi, mid, h;
+	long long num_matched = 0;
+	char *matched;
+	struct timespec ts0;
+
+	ts0 = phase_start();
+	winnow(qs, m, k, w, &q);
+	qsort(q.fp, q.n, sizeof(chunk_t), chunk_cmp);
+	phase_end(PH_INDEX, ts0, m);
+
+	ts0 = phase_start();
+	winnow(ts, n, k, w, &t);
+	matched = (char *)calloc(q.n > 0 ? q.n : 1, 1);
+	if (!matched) {
+		fprintf(stderr, " failed to allocate %lld bytes. No memory\n", q.n);
+		exit(1);
+	}
+	for (i = 0; i < t.n; i++) {
+		h = t.fp[i].hash;
+		for (lo = 0, hi = q.n; lo < hi; ) {
+			mid = lo + (hi - lo) / 2;
+			if (q.fp[mid].hash < h) {
+				lo = mid + 1;
+			} else {
+				hi = mid;
+			}
+		}
+		for (j = lo; j < q.n && q.fp[j].hash == h; j++) {
+			if (!matched[j] && memcmp(qs + q.fp[j].off, ts + t.fp[i].off, k) == 0) {
+				matched[j] = 1;
+				num_matched++;
+			}
+		}
 	}
-	printf("%llu\n", ps_hash);
+	phase_end(PH_SCAN, ts0, n);
 
-	// build the rest of the hashes
-	for (i=printed=0; i < n - k; i++) {
-		// print off the first PRINT_RK_HASH
-		if (printed < PRINT_RK_HASH) {
-			printf("%llu ", ts_hash);
-			printed++;
-		} else if(printed == PRINT_RK_HASH) {
-			printf("\n");
-			printed++;
+	*total = q.n;
+	free(matched);
+	free(q.fp);
+	free(t.fp);
+	return num_matched;
+}
+
+/* a posting of the CORPUS inverted index: a fingerprint hash and where it occurs */
+typedef struct {
+	long long hash;
+	long long off; /* offset in doc */
+	int doc;       /* doc number */
+} posting_t;
+
+static int
+posting_cmp(const void *a, const void *b)
+{
+	const posting_t *x = (const posting_t *)a;
+	const posting_t *y = (const posting_t *)b;
+
+	if (x->hash != y->hash) {
+		return (x->hash < y->hash) ? -1 : 1;
+	}
+	if (x->doc != y->doc) {
+		return (x->doc < y->doc) ? -1 : 1;
+	}
+	return (x->off < y->off) ? -1 : (x->off > y->off);
+}
+
+/* a pair of docs and the number of distinct fingerprints they share */
+typedef struct {
+	int a, b;
+	long long shared;
+	double score; /* the larger of the two docs' shares of the pair's fingerprints */
+} doc_pair;
+
+static int
+doc_pair_cmp(const void *x, const void *y)
+{
+	const doc_pair *p = (const doc_pair *)x;
+	const doc_pair *q = (const doc_pair *)y;
+
+	if (p->score != q->score) {
+		return (p->score > q->score) ? -1 : 1;
+	}
+	if (p->a != q->a) {
+		return p->a - q->a;
+	}
+	return p->b - q->b;
+}
+
+/* the place of the pair of docs a < b among the ndocs*(ndocs-1)/2 pairs */
+static inline long long
+pair_index(long long a, long long b, int ndocs)
+{
+	return a * ndocs - a * (a + 1) / 2 + (b - a - 1);
+}
+
+/* the share of a doc's nfp distinct fingerprints that are among the shared
+   ones, 0 for a doc too short to have any */
+static inline double
+fp_share(long long shared, long long nfp)
+{
+	return (nfp > 0) ? (double)shared / nfp : 0;
+}
+
+/* Compare all ndocs docs names[] with each other in one pass: winnow every
+   doc (see winnow), put all fingerprints in one inverted index, sorted by 
+   hash so that the postings of a hash are next to each other, and for every
+   distinct k-gram among them credit each pair of docs it occurs in. 
+   Print for every pair the share of each doc's distinct fingerprints that
+   the other one has, as the rows of a matrix, or the top pairs in order of 
+   the larger share if top > 0. A doc shorter than k has no fingerprints 
+   and shares none. ndocs is at most CORPUS_MAX_DOCS. */
+void
+corpus_match(char **names, int ndocs, int k, int w, int top)
+{
+	arena doc_arena;   /* all the docs, held until the end */
+	unsigned char **docs;
+	long long *doc_len;
+	long long *nfp;    /* number of distinct fingerprints of each doc */
+	long long *shared; /* shared[pair_index(a, b)], a < b: distinct fingerprints a and b share */
+	int *class_docs;   /* the distinct docs of the k-gram being credited */
+	char *done;        /* postings of the current hash already credited */
+	long long done_cap;
+	fp_list fl = {NULL, 0, 0};
+	posting_t *post = NULL;
+	long long npost = 0, cap = 0;
+	long long r, e, f, x, y, npairs = (long long)ndocs * (ndocs - 1) / 2;
+	doc_pair *pairs;
+	int d, nd;
+	struct timespec ts0;
+
+	arena_init(&doc_arena, DOC_ARENA_BLOCK);
+	docs = (unsigned char **)malloc(sizeof(unsigned char *) * ndocs);
+	doc_len = (long long *)malloc(sizeof(long long) * ndocs);
+	nfp = (long long *)calloc(ndocs, sizeof(long long));
+	shared = (long long *)calloc(npairs > 0 ? npairs : 1, sizeof(long long));
+	class_docs = (int *)malloc(sizeof(int) * ndocs);
+	if (!docs || !doc_len || !nfp || !shared || !class_docs) {
+		fprintf(stderr, " failed to allocate the state of %d docs. No memory\n", ndocs);
+		exit(1);
+	}
+
+	/* build the inverted index */
+	for (d = 0; d < ndocs; d++) {
+		prefetch_advance(prefetcher, d);
+		load_doc(&doc_arena, names[d], &docs[d], &doc_len[d]);
+		ts0 = phase_start();
+		fl.n = 0;
+		winnow(docs[d], doc_len[d], k, w, &fl);
+		if (npost + fl.n > cap) {
+			cap = 2 * (npost + fl.n);
+			post = (posting_t *)realloc(post, sizeof(posting_t) * cap);
+			if (!post) {
+				fprintf(stderr, " failed to allocate %lld postings. No memory\n", cap);
+				exit(1);
+			}
 		}
+		for (f = 0; f < fl.n; f++, npost++) {
+			post[npost].hash = fl.fp[f].hash;
+			post[npost].off = fl.fp[f].off;
+			post[npost].doc = d;
+		}
+		phase_end(PH_INDEX, ts0, doc_len[d]);
+	}
+	free(fl.fp);
 
-		// if we have a match, let's be sure
-		if (ts_hash == ps_hash) {
-			for (j = 0; j < k; j++) {
-				if (ts[i + j] != ps[j]) {
-					break;
+	ts0 = phase_start();
+	qsort(post, npost, sizeof(posting_t), posting_cmp);
+	phase_end(PH_INDEX, ts0, 0);
+
+	/* credit the pairs */
+	ts0 = phase_start();
+	done_cap = ndocs;
+	done = (char *)malloc(done_cap);
+	for (r = 0; r < npost; r = e) {
+		for (e = r + 1; e < npost && post[e].hash == post[r].hash; e++)
+			;
+		if (e - r > done_cap) {
+			done_cap = e - r;
+			done = (char *)realloc(done, done_cap);
+		}
+		if (!done) {
+			fprintf(stderr, " failed to allocate %lld bytes. No memory\n", e - r);
+			exit(1);
+		}
+		memset(done, 0, e - r);
+		/* the postings of one hash may hold several distinct k-grams */
+		for (x = r; x < e; x++) {
+			if (done[x - r]) {
+				continue;
+			}
+			nd = 0;
+			for (y = x; y < e; y++) {
+				if (done[y - r] || (y != x && 
+				    memcmp(docs[post[y].doc] + post[y].off, docs[post[x].doc] + post[x].off, k) != 0)) {
+					continue;
+				}
+				done[y - r] = 1;
+				/* postings are sorted by doc, so repeats of a doc are adjacent */
+				if (nd == 0 || class_docs[nd - 1] != post[y].doc) {
+					class_docs[nd++] = post[y].doc;
+				}
+			}
+			for (y = 0; y < nd; y++) {
+				nfp[class_docs[y]]++;
+				for (f = y + 1; f < nd; f++) {
+					shared[pair_index(class_docs[y], class_docs[f], ndocs)]++;
 				}
 			}
-			if (j == k) {
-				 response = 1;
+		}
+	}
+	free(done);
+	phase_end(PH_SCAN, ts0, npost);
+
+	if (top > 0) {
+		pairs = (doc_pair *)malloc(sizeof(doc_pair) * (npairs > 0 ? npairs : 1));
+		if (!pairs) {
+			fprintf(stderr, " failed to allocate %lld pairs. No memory\n", npairs);
+			exit(1);
+		}
+		for (x = 0, r = 0; x < ndocs; x++) {
+			for (y = x + 1; y < ndocs; y++, r++) {
+				pairs[r].a = (int)x;
+				pairs[r].b = (int)y;
+				pairs[r].shared = shared[r];
+				pairs[r].score = fp_share(pairs[r].shared, nfp[x]);
+				if (fp_share(pairs[r].shared, nfp[y]) > pairs[r].score) {
+					pairs[r].score = fp_share(pairs[r].shared, nfp[y]);
+				}
 			}
 		}
-		else {
-			// first remove last digit
-			ts_hash = mmul(base, mdel(ts_hash, mmul(ts[i], base_exp)));
-			// then add first digit
-			ts_hash = madd(ts_hash, ts[i + k]);
-			// keep it positive
-			while (ts_hash < 0) {
-				ts_hash = ts_hash + BIG_PRIME;
+		qsort(pairs, npairs, sizeof(doc_pair), doc_pair_cmp);
+		for (r = 0; r < npairs && r < top; r++) {
+			x = pairs[r].a;
+			y = pairs[r].b;
+			printf("%s %s: %lld fingerprints shared, percentage: %.2f %.2f\n", 
+			       names[x], names[y], pairs[r].shared, 
+			       fp_share(pairs[r].shared, nfp[x]), fp_share(pairs[r].shared, nfp[y]));
+		}
+		free(pairs);
+	} else {
+		/* row x, column y: the share of x's fingerprints that y has */
+		for (x = 0; x < ndocs; x++) {
+			printf("%s:", names[x]);
+			for (y = 0; y < ndocs; y++) {
+				f = (x < y) ? shared[pair_index(x, y, ndocs)] : 
+				    (x > y) ? shared[pair_index(y, x, ndocs)] : 0;
+				printf(" %.2f", (x == y) ? 1.0 : fp_share(f, nfp[x]));
 			}
+			printf("\n");
 		}
 	}
-	return response;
-}
 
+	arena_free(&doc_arena);
+	free(docs);
+	free(doc_len);
+	free(nfp);
+	free(shared);
+	free(class_docs);
+	free(post);
+}
 
 /* Allocate a bitmap containing bsz bits for the bloom filter (using the malloc library function), 
    and insert all m/k RK hashes of qs into the bloom filter.  Compute each of the n-k+1 RK hashes 
@@ -286,52 +4220,405 @@ rabin_karp_match(const unsigned char *ps,	/* the query string */
 	
    In the above example, the 14-th, and 20-th bits of the bloom filter are set to be "1"
  */
-int
-rabin_karp_batchmatch(int bsz, /* size of bitmap (in bits) to be used */
+long long
+rabin_karp_batchmatch(long long bsz, /* size of bitmap (in bits) to be used */
     int k, 					/* chunk length to be matched */
     const unsigned char *qs, /* query docoument (X)*/
-    int m, 					/* query document length */ 
+    long long m, 			/* query document length */ 
     const unsigned char *ts, /* to-be-matched document (Y) */
-    int n 					/* to-be-matched document length*/)
+    long long n 			/* to-be-matched document length*/)
+{
+
+	batch_index bi;
+	char *matched;
+	long long num_matched;
+
+	batch_index_build(&bi, bsz, k, qs, m);
+	if (index_type == INDEX_BLOOM) {
+		bloom_print(bi.bf, PRINT_BLOOM_BITS);
+	}
+
+	matched = (char *)calloc(bi.nchunks > 0 ? bi.nchunks : 1, 1);
+	if (!matched) {
+		fprintf(stderr, " failed to allocate %lld bytes. No memory\n", bi.nchunks);
+		exit(1);
+	}
+
+	num_matched = batch_index_scan(&bi, ts, n, matched);
+
+	free(matched);
+	batch_index_free(&bi);
+	return num_matched;
+}
+
+/* The distinct chunks of a query cut into chunks of k, which -t auto 
+   finds once before SIMPLE matches the docs: group i is the chunk at off[i]
+   in the query, which holds copies[i] copies of it. */
+typedef struct {
+	long long *off;
+	long long *copies;
+	long long n;      /* number of distinct chunks */
+} chunk_groups;
+
+/* Group the chunks of qs (m characters) in g: they are sorted by their W64
+   hash, so that identical ones are next to each other. */
+void
+chunk_groups_init(chunk_groups *g, const unsigned char *qs, long long m, int k)
+{
+	long long nchunks = m / k, a, b, e, f;
+	unsigned long long h;
+	chunk_t *ch;
+	char *grouped;
+	int i;
+
+	ch = (chunk_t *)malloc(sizeof(chunk_t) * (nchunks > 0 ? nchunks : 1));
+	grouped = (char *)calloc(nchunks > 0 ? nchunks : 1, 1);
+	g->off = (long long *)malloc(sizeof(long long) * (nchunks > 0 ? nchunks : 1));
+	g->copies = (long long *)malloc(sizeof(long long) * (nchunks > 0 ? nchunks : 1));
+	if (!ch || !grouped || !g->off || !g->copies) {
+		fprintf(stderr, " failed to allocate %lld chunks. No memory\n", nchunks);
+		exit(1);
+	}
+	for (a = 0; a < nchunks; a++) {
+		for (h = 0, i = 0; i < k; i++) {
+			h = (unsigned long long)rk_append_fam((long long)h, qs[a * k + i], HASH_W64);
+		}
+		ch[a].hash = (long long)h;
+		ch[a].off = a * k;
+	}
+	qsort(ch, nchunks, sizeof(chunk_t), chunk_cmp);
+
+	g->n = 0;
+	for (a = 0; a < nchunks; a = b) {
+		for (b = a + 1; b < nchunks && ch[b].hash == ch[a].hash; b++)
+			;
+		/* the chunks of a hash that are identical to chunk e, if not grouped yet */
+		for (e = a; e < b; e++) {
+			if (grouped[e]) {
+				continue;
+			}
+			g->off[g->n] = ch[e].off;
+			g->copies[g->n] = 0;
+			for (f = e; f < b; f++) {
+				if (!grouped[f] && memcmp(qs + ch[f].off, qs + ch[e].off, k) == 0) {
+					grouped[f] = 1;
+					g->copies[g->n]++;
+				}
+			}
+			g->n++;
+		}
+	}
+	free(grouped);
+	free(ch);
+}
+
+void
+chunk_groups_free(chunk_groups *g)
+{
+	free(g->off);
+	free(g->copies);
+	g->off = g->copies = NULL;
+	g->n = 0;
+}
+
+/* Count the chunks of qs (grouped in g, chunks of k) that appear in ts as
+   RKBATCH counts them: a chunk the query repeats is credited at most as 
+   many times as ts holds it (overlapping occurrences included), where 
+   SIMPLE credits every copy. A chunk the query holds once is looked for 
+   with simple_substr_match, one it holds c times has its occurrences 
+   counted up to c, so ts is passed over once per distinct chunk. -t auto 
+   runs SIMPLE with this count, so that its results do not depend on the
+   engine it picks. */
+long long
+simple_match_batch(const chunk_groups *g, const unsigned char *qs, int k, 
+    const unsigned char *ts, long long n)
+{
+	long long i, num_matched = 0;
+
+	for (i = 0; i < g->n; i++) {
+		num_matched += (g->copies[i] == 1) ? simple_substr_match(qs + g->off[i], k, ts, n)
+		    : simple_substr_count(qs + g->off[i], k, ts, n, g->copies[i]);
+	}
+	return num_matched;
+}
+
+/* the size of the doc fname, or -1 if it cannot be known before it is read
+   (the standard input, a pipe) */
+long long
+doc_size(const char *fname)
+{
+	struct stat sb;
+
+	if (strcmp(fname, "-") == 0 || stat(fname, &sb) < 0 || !S_ISREG(sb.st_mode)) {
+		return -1;
+	}
+	return sb.st_size;
+}
+
+/* Pick the engine for -t auto, given the query (NULL if the index is 
+   loaded from a file) and the ndocs docs, and set up those of its 
+   parameters the command line left open (*nthreads unless fixed_threads,
+   index_type unless fixed_index, which_hash unless fixed_hash): SIMPLE if its passes over the docs cost less than 
+   scanning them with an RKBATCH index, by the auto_*_ns costs, and 
+   RKBATCH otherwise, and also if a doc's size is unknown or batch_only 
+   is set. RKBATCH then hashes with W64, uses the chunk table alone if it
+   is small enough to stay in cache and behind a bloom filter otherwise, 
+   and takes a thread per PARALLEL_SPLIT_MIN bytes of docs, or per doc,
+   up to the number of CPUs.
+   A query that repeats a chunk is counted the same either way: SIMPLE 
+   picked here counts with simple_match_batch, as RKBATCH does. It groups
+   the query's chunks first (chunk_groups_init), hashing and sorting them 
+   as building the index does, so the two are charged the same for the 
+   query and weighed by their costs per doc byte alone. */
+int
+auto_select(const char *query, char **docs, int ndocs, int k, int batch_only, 
+    int fixed_hash, int fixed_index, int fixed_threads, int *nthreads)
+{
+	long long m, n = 0, sz, nchunks, t, ncpu;
+	int d;
+
+	m = query ? doc_size(query) : -1;
+	for (d = 0; d < ndocs && n >= 0; d++) {
+		sz = doc_size(docs[d]);
+		n = (sz < 0) ? -1 : n + sz;
+	}
+	if (query && m >= 0 && n >= 0 && !batch_only
+	    && (double)(m / k) * n * auto_simple_ns < n * auto_scan_ns) {
+		return SIMPLE;
+	}
+
+	if (!fixed_hash) {
+		which_hash = HASH_W64;
+	}
+	nchunks = (m > 0) ? m / k : 0;
+	if (!fixed_index) {
+		index_type = (query && nchunks * 2 * (long long)sizeof(chunk_t) <= AUTO_TABLE_MAX) ? INDEX_TABLE : INDEX_FILTERED;
+	}
+	if (!fixed_threads) {
+		t = (n < 0) ? 1 : n / PARALLEL_SPLIT_MIN;
+		if (t < ndocs) {
+			t = ndocs;
+		}
+		ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		*nthreads = (t < ncpu) ? t : (ncpu > 0 ? ncpu : 1);
+	}
+	return RKBATCH;
+}
+
+/* print how many of the total query chunks were matched in one doc,
+   prefixed by the doc's name unless name is NULL */
+void
+print_matched(const char *name, long long num_matched, long long total)
+{
+	if (name) {
+		printf("%s: ", name);
+	}
+	printf("%lld chunks matched (out of %lld), percentage: %.2f\n", 
+	       num_matched, total, (double)num_matched/total);
+}
+
+/* Parse the argument of -k, a match size or a comma separated list of up
+   to MULTI_K_MAX of them, into ks[]. Return how many were given. */
+static int
+parse_k_list(const char *arg, int *ks)
 {
+	char *end;
+	int n = 0;
 
-    /* nothing in the instructions talks about a bloom filter or bitmap... are we meant to do do this??? */
-    return 0;
+	for (;;) {
+		if (n == MULTI_K_MAX) {
+			fprintf(stderr, "at most %d match sizes can be given to -k\n", MULTI_K_MAX);
+			exit(1);
+		}
+		ks[n++] = (int)strtol(arg, &end, 10);
+		if (*end != ',') {
+			break;
+		}
+		arg = end + 1;
+	}
+	return n;
 }
 
 int 
 main(int argc, char **argv)
 {
 	int k = 20; /* default match size is 20*/
+	int multi_k[MULTI_K_MAX];  /* the match sizes given to -k */
+	int nk = 1;                /* if > 1, RKBATCH matches with all of multi_k[] in one pass */
 	int which_algo = SIMPLE; /* default match algorithm is simple */
+	int auto_algo = 0;       /* which_algo was picked by -t auto */
 
 	unsigned char *qdoc, *doc; 
-	int qdoc_len, doc_len;
-	int i;
-	int num_matched = 0;
+	long long qdoc_len, doc_len;
+	long long i;
+	long long num_matched = 0;
+	long long total;
+	long long stream_block = 0; /* if > 0, RKBATCH streams doc in blocks of this size */
+	int nthreads = 1;           /* number of threads RKBATCH scans with */
+	static thread_pool pool; /* static: work_pool points at it */
+	long long *results = NULL;
+	batch_index bi;
+	char *matched = NULL;
+	batch_index bis[MULTI_K_MAX];     /* the index for each of multi_k[] */
+	char *matched_k[MULTI_K_MAX];
+	long long results_k[MULTI_K_MAX];
+	chunk_groups groups;             /* the query's distinct chunks, for SIMPLE picked by -t auto */
+	int j;
+	const char *name;
+	int fd;
+	int ndocs, d, first_doc;
 	int c;
+	struct timespec ts0;
+	const char *index_out = NULL; /* save the RKBATCH index to this file */
+	const char *index_in = NULL;  /* load the RKBATCH index from this file */
+	const char *index_append = NULL; /* append the RKBATCH index to this file */
+	long long delete_seg = -1;    /* delete this segment of the -l index file */
+	int compact = 0;              /* compact the -l index file */
+	int list_segs = 0;            /* list the segments of the -l index file */
+	int index_op;                 /* -L, -X or -C were given */
+	int index_op_only = 0;        /* ... and no docs, so nothing is scanned */
+	long long nlive;
+	int fixed_hash = 0, fixed_index = 0, fixed_threads = 0; /* left to -t auto unless given */
+	const char *region_file = NULL; /* write RKBATCH's matching regions to this file */
+	int region_format = REGION_NDJSON;
+	region_writer rw;
+	int orig_offsets = 0;    /* write the regions with offsets into the original files */
+	file_map qorig, torig;
+	offset_map qmap, tmap;
+	arena run_arena;         /* what lives for the whole run: the query */
+	arena doc_arena;         /* what lives for one doc, reset after each */
+	static doc_prefetcher pf; /* reads the docs ahead; static: prefetcher points at it */
+	struct timespec start = phase_start();
+	static const struct option long_opts[] = {
+		{"stats", optional_argument, NULL, 'S'},
+		{NULL, 0, NULL, 0}
+	};
 
 	/* Refuse to run on platform with a different size for long long*/
 	assert(sizeof(long long) == 8);
 
-	/*getopt is a C library function to parse command line options */
-	while (( c = getopt(argc, argv, "t:k:q:")) != -1) {
+	/*getopt is a C library function to parse command line options;
+	  getopt_long also takes the long option --stats[=file] */
+	while (( c = getopt_long(argc, argv, "t:k:q:b:f:s:j:Ti:e:o:l:w:K:m:M:OA:X:CL", long_opts, NULL)) != -1) {
 		switch (c) 
 		{
 			case 't':
 				/*optarg is a global variable set by getopt() 
 					it now points to the text following the '-t' */
-				which_algo = atoi(optarg);
+				which_algo = (strcmp(optarg, "auto") == 0) ? AUTO : atoi(optarg);
 				break;
 			case 'k':
-				k = atoi(optarg);
+				nk = parse_k_list(optarg, multi_k);
+				k = multi_k[0];
 				break;
 			case 'q':
-				BIG_PRIME = atoi(optarg);
+				BIG_PRIME = atoll(optarg);
+				if (BIG_PRIME < 2 || BIG_PRIME > (1LL << 62)) {
+					fprintf(stderr, "prime modulus must be between 2 and 2^62\n");
+					exit(1);
+				}
+				fixed_hash = 1;
+				break;
+			case 'f':
+				which_hash = atoi(optarg);
+				if (which_hash < HASH_MOD || which_hash > HASH_W64) {
+					fprintf(stderr, "Wrong hash family, choose from 0 1 2\n");
+					exit(1);
+				}
+				fixed_hash = 1;
+				break;
+			case 'b':
+				bloom_layout = atoi(optarg);
+				break;
+			case 's':
+				stream_block = atoll(optarg);
+				if (stream_block <= 0) {
+					fprintf(stderr, "streaming block size must be positive\n");
+					exit(1);
+				}
+				break;
+			case 'j':
+				nthreads = atoi(optarg);
+				if (nthreads < 1) {
+					fprintf(stderr, "number of threads must be positive\n");
+					exit(1);
+				}
+				fixed_threads = 1;
+				break;
+			case 'T':
+				timing = 1;
+				break;
+			case 'i':
+				index_type = atoi(optarg);
+				if (index_type < INDEX_BLOOM || index_type > INDEX_FILTERED) {
+					fprintf(stderr, "Wrong index type, choose from 0 1 2\n");
+					exit(1);
+				}
+				fixed_index = 1;
+				break;
+			case 'e':
+				filter_fp = atof(optarg);
+				if (filter_fp <= 0 || filter_fp >= 1) {
+					fprintf(stderr, "false positive rate must be between 0 and 1\n");
+					exit(1);
+				}
+				break;
+			case 'o':
+				index_out = optarg;
+				break;
+			case 'l':
+				index_in = optarg;
+				break;
+			case 'w':
+				winnow_w = atoi(optarg);
+				if (winnow_w < 1) {
+					fprintf(stderr, "winnowing window must be positive\n");
+					exit(1);
+				}
+				break;
+			case 'K':
+				corpus_top = atoi(optarg);
+				if (corpus_top < 0) {
+					fprintf(stderr, "number of top pairs must not be negative\n");
+					exit(1);
+				}
+				break;
+			case 'm':
+				region_file = optarg;
+				break;
+			case 'M':
+				region_format = atoi(optarg);
+				if (region_format < REGION_NDJSON || region_format > REGION_BINARY) {
+					fprintf(stderr, "Wrong region format, choose from 0 1\n");
+					exit(1);
+				}
+				break;
+			case 'O':
+				orig_offsets = 1;
+				break;
+			case 'S':
+				stats = 1;
+				stats_file = optarg;
+				break;
+			case 'A':
+				index_append = optarg;
+				break;
+			case 'X':
+				delete_seg = atoll(optarg);
+				if (delete_seg < 0) {
+					fprintf(stderr, "segment number must not be negative\n");
+					exit(1);
+				}
+				break;
+			case 'C':
+				compact = 1;
+				break;
+			case 'L':
+				list_segs = 1;
 				break;
 			default:
 				fprintf(stderr,
-						"Valid options are: -t <algo type> -k <match size> -q <prime modulus>\n");
+						"Valid options are: -t <algo type> -k <match size[,match size...]> -q <prime modulus> -b <bloom layout> -f <hash family> -s <stream block size> -j <threads> -T -i <index type> -e <false positive rate> -o <index file to save> -l <index file to load> -w <winnowing window> -K <top pairs> -m <region file> -M <region format> -O -A <index file to append to> -X <segment to delete> -C -L --stats[=<json file>]\n");
 				exit(1);
 			}
 	}
@@ -339,65 +4626,369 @@ main(int argc, char **argv)
 	/* optind is a global variable set by getopt() 
 		 it now contains the index of the first argv-element 
 		 that is not an option*/
-	if (argc - optind < 1) {
-		printf("Usage: ./rkmatch query_doc doc\n");
+	index_op = list_segs || delete_seg >= 0 || compact;
+	if (argc - optind < (index_in ? !index_op : (index_out || index_append) ? 1 : 2)) {
+		printf("Usage: ./rkmatch query_doc doc1 [doc2...]\n");
+		exit(1);
+	}
+	if (index_op && !index_in) {
+		fprintf(stderr, "-L, -X and -C work on the index file given with -l\n");
+		exit(1);
+	}
+	if (index_append && (index_in || index_out)) {
+		fprintf(stderr, "-A cannot be used with -o or -l\n");
+		exit(1);
+	}
+	if (index_append && (d = batch_index_settings(index_append)) > 0) {
+		/* the new segment must agree with the ones in the file */
+		k = d;
+		fixed_hash = fixed_index = 1;
+	}
+	if (which_algo == AUTO) {
+		auto_algo = 1;
+		/* only RKBATCH streams, runs on threads, has index files and writes regions */
+		d = index_in ? optind : optind + 1;
+		which_algo = auto_select(index_in ? NULL : argv[optind], argv + d, argc - d, k, 
+		    stream_block > 0 || nthreads > 1 || index_out || index_in || index_append || region_file || nk > 1, 
+		    fixed_hash, fixed_index, fixed_threads || region_file || nk > 1, &nthreads);
+		if (timing) {
+			fprintf(stderr, "auto: -t %d -i %d -f %d -j %d\n", which_algo, index_type, which_hash, nthreads);
+		}
+	}
+	if (which_algo < EXACT || which_algo > CORPUS) {
+		fprintf(stderr,"Wrong algorithm type, choose from 0 1 2 3 4 5 auto\n");
+		exit(1);
+	}
+	if (which_algo == CORPUS && argc - optind > CORPUS_MAX_DOCS) {
+		fprintf(stderr, "CORPUS (-t 5) compares at most %d docs\n", CORPUS_MAX_DOCS);
+		exit(1);
+	}
+	if (stream_block > 0 && which_algo != RKBATCH) {
+		fprintf(stderr, "streaming (-s) is only supported by RKBATCH (-t 3)\n");
+		exit(1);
+	}
+	if (nthreads > 1 && which_algo != RKBATCH) {
+		fprintf(stderr, "multithreading (-j) is only supported by RKBATCH (-t 3)\n");
+		exit(1);
+	}
+	if ((index_out || index_in || index_append) && which_algo != RKBATCH) {
+		fprintf(stderr, "index files (-o, -l, -A) are only supported by RKBATCH (-t 3)\n");
+		exit(1);
+	}
+	if (index_out && index_in) {
+		fprintf(stderr, "-o and -l cannot be used together\n");
+		exit(1);
+	}
+	if (region_file && (which_algo != RKBATCH || stream_block > 0 || nthreads > 1)) {
+		fprintf(stderr, "regions (-m) are only written by RKBATCH (-t 3) on one thread, without -s\n");
+		exit(1);
+	}
+	if (orig_offsets && (!region_file || index_in)) {
+		fprintf(stderr, "original offsets (-O) need regions (-m) and a query_doc (not -l)\n");
+		exit(1);
+	}
+	if (nk > 1 && (which_algo != RKBATCH || stream_block > 0 || nthreads > 1 || 
+	    index_out || index_in || index_append || region_file)) {
+		fprintf(stderr, "several match sizes (-k) are only supported by RKBATCH (-t 3) on one thread, without -s, -o, -l, -A or -m\n");
 		exit(1);
 	}
+	for (j = 0; j < nk; j++) {
+		if (nk > 1 && multi_k[j] < 1) {
+			fprintf(stderr, "match sizes must be positive\n");
+			exit(1);
+		}
+	}
+
+	if (stats) {
+		perf_open();
+	}
+	arena_init(&run_arena, DOC_ARENA_BLOCK);
+	arena_init(&doc_arena, DOC_ARENA_BLOCK);
+
+	if (which_algo == CORPUS) {
+		/* there is no query_doc argument; every doc is compared with every other */
+		prefetcher_start(&pf, argv + optind, argc - optind);
+		prefetcher = &pf;
+		corpus_match(argv + optind, argc - optind, k, winnow_w, corpus_top);
+		prefetcher_stop(&pf);
+		prefetcher = NULL;
+		if (timing) {
+			phase_report();
+		}
+		if (stats) {
+			stats_report(which_algo, k, nthreads, argc - optind, timediff_ns(phase_start(), start));
+		}
+		return 0;
+	}
 
-	/* argv[optind] contains the query_doc argument */
-	read_file(argv[optind], &qdoc, &qdoc_len); 
-	qdoc_len = normalize(qdoc, qdoc_len);
+	if (which_algo == RKBATCH && nthreads > 1) {
+		/* the threads normalize the query, build the index (or compact it) and then scan */
+		pool_init(&pool, nthreads);
+		work_pool = &pool;
+	}
 
-	/* argv[optind+1] contains the doc argument */
-	read_file(argv[optind+1], &doc, &doc_len);
-	doc_len = normalize(doc, doc_len);
+	if (index_in) {
+		/* there is no query_doc argument; the index holds the query */
+		qdoc = NULL;
+		first_doc = optind;
+	} else {
+		/* argv[optind] contains the query_doc argument */
+		if (orig_offsets) {
+			load_doc_keep(&run_arena, argv[optind], &qdoc, &qdoc_len, &qorig);
+			offset_map_init(&qmap, &qorig);
+		} else {
+			load_doc(&run_arena, argv[optind], &qdoc, &qdoc_len); 
+		}
+		first_doc = optind + 1;
+	}
+	ndocs = argc - first_doc;
+	if (ndocs > 0) {
+		/* the docs are read ahead while the index is built and the earlier docs are matched */
+		prefetcher_start(&pf, argv + first_doc, ndocs);
+		prefetcher = &pf;
+	}
 
-	switch (which_algo) 
-		{
-            case EXACT:
-                if (exact_match(qdoc, qdoc_len, doc, doc_len)) 
-                    printf("Exact match\n");
-                else
-                    printf("Not an exact match\n");
-                break;
-			case SIMPLE:
-				/* for each chunk of qdoc (out of qdoc_len/k chunks of qdoc, 
-					 check if it appears in doc as a substring*/
-				for (i = 0; (i+k) <= qdoc_len; i += k) {
-					if (simple_substr_match(qdoc+i, k, doc, doc_len)) {
-						num_matched++;
-					}
-				}
-                printf("%d chunks matched (out of %d), percentage: %.2f\n", \
-                       num_matched, qdoc_len/k, (double)num_matched/(qdoc_len/k));
-				break;
-			case RK:
-				/* for each chunk of qdoc (out of qdoc_len/k in total), 
-					 check if it appears in doc as a substring using 
-				   the rabin-karp substring matching algorithm */
-				for (i = 0; (i+k) <= qdoc_len; i += k) {
-					if (rabin_karp_match(qdoc+i, k, doc, doc_len)) {
-						num_matched++;
-					}
+	if (which_algo == RKBATCH && index_op) {
+		/* maintenance of the index file comes before matching against it */
+		if (delete_seg >= 0) {
+			batch_index_delete(index_in, delete_seg);
+		}
+		if (compact) {
+			batch_index_compact(index_in);
+		}
+		if (list_segs) {
+			batch_index_list(index_in);
+		}
+		index_op_only = (ndocs == 0);
+	}
+
+	if (which_algo == SIMPLE && auto_algo) {
+		/* the repeated chunks are found once, as RKBATCH builds its index once */
+		ts0 = phase_start();
+		chunk_groups_init(&groups, qdoc, qdoc_len, k);
+		phase_end(PH_INDEX, ts0, qdoc_len);
+	} else if (which_algo == RKBATCH && nk > 1) {
+		/* an index per match size, all of the same query, each doc is scanned once for all of them */
+		ts0 = phase_start();
+		for (j = 0; j < nk; j++) {
+			batch_index_build(&bis[j], batch_bloom_bits(qdoc_len, multi_k[j]), multi_k[j], qdoc, qdoc_len);
+		}
+		phase_end(PH_INDEX, ts0, qdoc_len * nk);
+		for (j = 0; j < nk; j++) {
+			if (index_type == INDEX_BLOOM && bis[j].bf.buf) {
+				bloom_print(bis[j].bf, PRINT_BLOOM_BITS);
+			}
+			matched_k[j] = (char *)malloc(bis[j].all_chunks > 0 ? bis[j].all_chunks : 1);
+			if (!matched_k[j]) {
+				fprintf(stderr, " failed to allocate %lld bytes. No memory\n", bis[j].all_chunks);
+				exit(1);
+			}
+		}
+	} else if (which_algo == RKBATCH && !index_op_only) {
+		/* the query side is built once and reused for every doc */
+		ts0 = phase_start();
+		if (index_in) {
+			qdoc_len = batch_index_load(&bi, index_in);
+			k = bi.k;
+		} else {
+			batch_index_build(&bi, batch_bloom_bits(qdoc_len, k), k, qdoc, qdoc_len);
+		}
+		phase_end(PH_INDEX, ts0, qdoc_len);
+		if (index_out) {
+			batch_index_save(&bi, qdoc_len, index_out, argv[optind]);
+		}
+		if (index_append) {
+			nlive = batch_index_append(&bi, qdoc_len, index_append, argv[optind]);
+			if (nlive > INDEX_MAX_SEGMENTS) {
+				/* merge the segments in a child; this run goes on with the file as it is */
+				fflush(NULL);
+				if (fork() == 0) {
+					/* the pool's threads are not in the child */
+					work_pool = NULL;
+					batch_index_compact(index_append);
+					_exit(0);
 				}
-                printf("%d chunks matched (out of %d), percentage: %.2f\n", \
-                       num_matched, qdoc_len/k, (double)num_matched/(qdoc_len/k));
-				break;
-			case RKBATCH:
-				/* match all qdoc_len/k chunks simultaneously (in batch) by using a bloom filter*/
-				num_matched = rabin_karp_batchmatch(((qdoc_len*10/k)>>3)<<3, k, \
-                        qdoc, qdoc_len, doc, doc_len);
-                printf("%d chunks matched (out of %d), percentage: %.2f\n", \
-                       num_matched, qdoc_len/k, (double)num_matched/(qdoc_len/k));
-				break;
-			default :
-				fprintf(stderr,"Wrong algorithm type, choose from 0 1 2 3\n");
+			}
+			/* the docs are matched against every segment of the file */
+			batch_index_free(&bi);
+			qdoc_len = batch_index_load(&bi, index_append);
+		}
+		if (bi.next && region_file) {
+			fprintf(stderr, "regions (-m) need an index of a single segment; compact it with -C\n");
+			exit(1);
+		}
+		if (index_type == INDEX_BLOOM && bi.bf.buf) {
+			bloom_print(bi.bf, PRINT_BLOOM_BITS);
+		}
+		matched = (char *)malloc(bi.all_chunks > 0 ? bi.all_chunks : 1);
+		if (!matched) {
+			fprintf(stderr, " failed to allocate %lld bytes. No memory\n", bi.all_chunks);
+			exit(1);
+		}
+		if (region_file) {
+			region_writer_open(&rw, region_file, region_format, orig_offsets ? &qmap : NULL);
+		}
+
+		if (nthreads > 1) {
+			/* scan all docs up front; the loop below only reports */
+			results = (long long *)malloc(sizeof(long long) * ndocs);
+			if (!results) {
+				fprintf(stderr, " failed to allocate %d results. No memory\n", ndocs);
 				exit(1);
+			}
+			batch_match_parallel(&bi, argv + first_doc, ndocs, stream_block, &pool, results);
+			pool_free(&pool);
+			work_pool = NULL;
 		}
-	
+	}
+
+	/* argv[first_doc] ... argv[argc-1] contain the doc arguments */
+	for (d = first_doc; d < argc; d++) {
+		prefetch_advance(prefetcher, d - first_doc);
+		num_matched = 0;
+		doc = NULL;
+		doc_len = 0;
+		if (stream_block <= 0 && !results) {
+			if (orig_offsets) {
+				load_doc_keep(&doc_arena, argv[d], &doc, &doc_len, &torig);
+				offset_map_init(&tmap, &torig);
+				rw.tmap = &tmap;
+			} else {
+				load_doc(&doc_arena, argv[d], &doc, &doc_len);
+			}
+		}
+		/* results are only labelled when there is more than one doc */
+		name = (ndocs > 1) ? argv[d] : NULL;
+
+		/* RKBATCH and WINNOW time their own scans; the others are charged a pass over doc per chunk */
+		ts0 = phase_start();
+		switch (which_algo) 
+			{
+				case EXACT:
+					if (name)
+						printf("%s: ", name);
+					if (exact_match(qdoc, qdoc_len, doc, doc_len)) 
+						printf("Exact match\n");
+					else
+						printf("Not an exact match\n");
+					phase_end(PH_SCAN, ts0, (qdoc_len == doc_len) ? doc_len : 0);
+					break;
+				case SIMPLE:
+					/* for each chunk of qdoc (out of qdoc_len/k chunks of qdoc, 
+						 check if it appears in doc as a substring*/
+					if (auto_algo) {
+						num_matched = simple_match_batch(&groups, qdoc, k, doc, doc_len);
+					} else {
+						for (i = 0; (i+k) <= qdoc_len; i += k) {
+							if (simple_substr_match(qdoc+i, k, doc, doc_len)) {
+								num_matched++;
+							}
+						}
+					}
+					phase_end(PH_SCAN, ts0, doc_len * (qdoc_len/k));
+					print_matched(name, num_matched, qdoc_len/k);
+					break;
+				case RK:
+					/* for each chunk of qdoc (out of qdoc_len/k in total), 
+						 check if it appears in doc as a substring using 
+					   the rabin-karp substring matching algorithm */
+					for (i = 0; (i+k) <= qdoc_len; i += k) {
+						if (rabin_karp_match(qdoc+i, k, doc, doc_len)) {
+							num_matched++;
+						}
+					}
+					phase_end(PH_SCAN, ts0, doc_len * (qdoc_len/k));
+					print_matched(name, num_matched, qdoc_len/k);
+					break;
+				case RKBATCH:
+					if (nk > 1) {
+						/* one pass over doc for all the match sizes, a line for each */
+						for (j = 0; j < nk; j++) {
+							memset(matched_k[j], 0, bis[j].all_chunks);
+						}
+						batch_index_scan_multi(bis, nk, doc, doc_len, matched_k, results_k);
+						for (j = 0; j < nk; j++) {
+							if (name) {
+								printf("%s: ", name);
+							}
+							printf("k=%d: ", bis[j].k);
+							print_matched(NULL, results_k[j], bis[j].all_chunks);
+						}
+						break;
+					}
+					/* match all qdoc_len/k chunks simultaneously (in batch) by using a bloom filter*/
+					memset(matched, 0, bi.all_chunks);
+					if (results) {
+						num_matched = results[d - first_doc];
+					} else if (stream_block > 0) {
+						/* doc is never held in memory as a whole */
+						fd = open_doc(argv[d]);
+						if (fd < 0) {
+							perror("rkmatch: open ");
+							exit(1);
+						}
+						num_matched = batch_index_scan_fd(&bi, fd, stream_block, matched);
+						close(fd);
+					} else if (region_file) {
+						num_matched = batch_index_scan_regions(&bi, qdoc_len, doc, doc_len, 
+						    matched, &rw, d - first_doc);
+					} else {
+						num_matched = batch_index_scan(&bi, doc, doc_len, matched);
+					}
+					print_matched(name, num_matched, bi.all_chunks);
+					break;
+				case WINNOW:
+					/* compare only the winnowed fingerprints of qdoc and doc */
+					num_matched = winnow_match(qdoc, qdoc_len, doc, doc_len, k, winnow_w, &total);
+					if (name) {
+						printf("%s: ", name);
+					}
+					printf("%lld fingerprints matched (out of %lld), percentage: %.2f\n", 
+					       num_matched, total, (double)num_matched/total);
+					break;
+			}
+
+		arena_reset(&doc_arena);
+		if (orig_offsets) {
+			offset_map_free(&tmap);
+		}
+	}
 
-	free(qdoc);
-	free(doc);
+	if (which_algo == SIMPLE && auto_algo) {
+		chunk_groups_free(&groups);
+	} else if (which_algo == RKBATCH && nk > 1) {
+		for (j = 0; j < nk; j++) {
+			free(matched_k[j]);
+			batch_index_free(&bis[j]);
+		}
+	} else if (which_algo == RKBATCH && !index_op_only) {
+		if (region_file) {
+			region_writer_close(&rw);
+		}
+		if (orig_offsets) {
+			offset_map_free(&qmap);
+		}
+		free(matched);
+		free(results);
+		batch_index_free(&bi);
+	}
+	if (work_pool) {
+		/* the docs were not scanned on it */
+		pool_free(&pool);
+		work_pool = NULL;
+	}
+	if (prefetcher) {
+		prefetcher_stop(&pf);
+		prefetcher = NULL;
+	}
+	arena_free(&doc_arena);
+	arena_free(&run_arena);
 
+	if (timing) {
+		phase_report();
+	}
+	if (stats) {
+		stats_report(which_algo, k, nthreads, ndocs, timediff_ns(phase_start(), start));
+	}
 	return 0;
 }
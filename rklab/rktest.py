@@ -211,6 +211,88 @@ def test_near_miss(algo,fsize):
 		print "   test with file X (",len(xs), "bytes) and Y (",len(ys), "bytes), Y has a ", THRES, "char string copied from X"
 		test_command(prog="./rkmatch",args=["-t",str(algo), "-k", str(THRES), "X", "Y"])
 
+def run_rkmatch(args):
+	cmd = ["./rkmatch"] + args
+	if VERBOSE:
+		print "--- run command '", ' '.join(cmd), "'"
+	p = subprocess.Popen(cmd,stdout=subprocess.PIPE,stderr=subprocess.PIPE)
+	[s,ss] = p.communicate()
+	r = p.wait()
+	if (r != 0) :
+		print "./rkmatch did not terminate normally (returncode=%d)" % r
+		sys.exit(1)
+	return [s,ss]
+
+def test_auto_duplicates(fsize):
+	xs = get_rand_string(fsize)
+	chunk = xs[:THRES]
+	for i in range(2*THRES, len(xs)-THRES, 3*THRES):
+		xs[i:i+THRES] = chunk
+	write_to_file(xs,'X')
+	yys = get_rand_string(fsize)
+	for copies in range(4):
+		ys = list(yys)
+		for i in range(copies):
+			cut = random.randint(0, len(ys)-1)
+			ys[cut:cut] = [' '] + chunk + [' ']
+		write_to_file(ys,'Y')
+		print "   test with file X (",len(xs), "bytes) and Y (",len(ys), "bytes), X repeats a chunk that Y holds", copies, "times"
+		[s1,ss1] = run_rkmatch(["-T", "-t", "auto", "-k", str(THRES), "X", "Y"])
+		if ss1.find("auto: -t 1") < 0:
+			print "-t auto did not pick the simple algorithm for small files"
+			sys.exit(1)
+		[s2,ss2] = run_rkmatch(["-t", "3", "-i", "1", "-k", str(THRES), "X", "Y"])
+		if (s1!=s2):
+			print "-t auto (simple) and -t 3 count a repeated chunk differently"
+			print_diff(s2, s1)
+			sys.exit(1)
+
+def test_multi_k(fsize):
+	xs = get_rand_string(fsize)
+	write_to_file(xs,'X')
+	ys = get_rand_string(fsize)
+	ys += [' '] + get_denormalized(xs[:fsize//2]) + [' ']
+	write_to_file(ys,'Y')
+	for fam in range(3):
+		for q in [[], ["-q", "4611686018427387847"]]:
+			if fam != 0 and q:
+				continue
+			print "   test with file X (",len(xs), "bytes) and Y (",len(ys), "bytes), hash family", fam, ' '.join(q)
+			[s1,ss1] = run_rkmatch(["-t", "3", "-f", str(fam)] + q + ["-k", "10,20,40", "X", "Y"])
+			counts = [l for l in s1.split('\n') if l.startswith("k=")]
+			for k in [10, 20, 40]:
+				[s2,ss2] = run_rkmatch(["-t", "3", "-f", str(fam)] + q + ["-k", str(k), "X", "Y"])
+				s2 = "k=%d: " % k + s2.strip().split('\n')[-1]
+				if s2 not in counts:
+					print "-k 10,20,40 and -k", k, "count the chunks of size", k, "differently"
+					print_diff(s2, '\n'.join(counts))
+					sys.exit(1)
+
+def test_compact(fsize):
+	xs = get_rand_string(fsize)
+	write_to_file(xs,'X')
+	write_to_file(xs[:fsize//2],'Z')
+	ys = get_rand_string(fsize)
+	ys += [' '] + get_denormalized(xs) + [' ']
+	ys += get_rand_string(fsize)
+	ys += [' '] + xs[fsize//4:] + [' ']
+	write_to_file(ys,'Y')
+	for idx in range(3):
+		subprocess.call(["rm", "-f", "I"])
+		for q in ['X', 'X', 'Z']:
+			run_rkmatch(["-t", "3", "-i", str(idx), "-k", str(THRES), "-A", "I", q])
+		print "   test with index type", idx, "of segments X, X and half of X and file Y (",len(ys), "bytes), Y holds X and part of it again"
+		[s1,ss1] = run_rkmatch(["-t", "3", "-l", "I", "Y"])
+		run_rkmatch(["-t", "3", "-l", "I", "-C"])
+		[s2,ss2] = run_rkmatch(["-t", "3", "-l", "I", "Y"])
+		# the bloom filter printed before the count is rebuilt by compacting
+		s1 = s1.strip().split('\n')[-1]
+		s2 = s2.strip().split('\n')[-1]
+		if (s1!=s2):
+			print "compacting the index changed the number of chunks matched"
+			print_diff(s1, s2)
+			sys.exit(1)
+
 if __name__ == '__main__':
 
 	parser = OptionParser()
@@ -252,3 +334,17 @@ if __name__ == '__main__':
 		test_near_miss(3,30000)
 		print "Test RKBATCH passed"
 
+	if (options.typeofalgo == "auto" or options.typeofalgo is None): 
+		print "Test auto ...."
+		test_auto_duplicates(3000)
+		print "Test auto passed"
+
+	if (options.typeofalgo == "multik" or options.typeofalgo is None): 
+		print "Test several match sizes ...."
+		test_multi_k(30000)
+		print "Test several match sizes passed"
+
+	if (options.typeofalgo == "compact" or options.typeofalgo is None): 
+		print "Test compact ...."
+		test_compact(30000)
+		print "Test compact passed"